@@ -6,6 +6,8 @@
 #include "registers.h"
 #include "bb_i2c.h"
 #include "board.h"
+#include "schedule.h"
+#include "events.h"
 
 
 extern void power_down( void );
@@ -14,6 +16,19 @@ extern void power_event( uint8_t reason );
 volatile uint16_t system_ticks;
 volatile uint32_t countdown;
 volatile uint32_t seconds;
+volatile int16_t rtc_trim;
+volatile uint32_t alarm;
+volatile uint8_t button_settled;
+static volatile uint8_t running;
+static volatile uint8_t long_tick;
+
+// Button debounce on timer0, 10 ms at clk/1024
+#define DEBOUNCE_COUNT  78
+
+// One timer2 count (1/256 s) in units of 0.05 us.  rtc_trim in 0.1 ppm
+// is 2 of these units per second.
+#define TRIM_COUNT      78125L
+static int32_t trim_acc;
 
 
 uint8_t board_begin_countdown( void )
@@ -31,6 +46,134 @@ uint8_t board_begin_countdown( void )
 }
 
 
+// Seconds and the 1/256 s fraction from TCNT2, taken together.  Must be
+// called with interrupts disabled.
+uint32_t board_get_rtc( uint8_t *fraction )
+{
+    uint8_t t = TCNT2;
+    uint32_t s = seconds;
+
+    // Counter wrapped but the overflow is not serviced yet
+    if ( TIFR2 & ( 1 << TOV2 ) )
+    {
+        t = TCNT2;
+        s += long_tick ? LONG_TICK_SECONDS : 1;
+    }
+
+    // A long tick count is 1/32 s
+    if ( long_tick )
+    {
+        s += t / 32;
+        t = ( t % 32 ) * LONG_TICK_SECONDS;
+    }
+
+    *fraction = t;
+    return s;
+}
+
+
+// Set the RTC and start the second over from zero.  Must be called with
+// interrupts disabled.  The schedule is rebased later from the main loop.
+void board_set_rtc( uint32_t value )
+{
+    GTCCR = ( 1 << PSRASY );    // clear the async prescaler phase
+    TCNT2 = 0;
+    TIFR2 = ( 1 << TOV2 );
+    seconds = value;
+    registers_set_seconds( value );
+    schedule_clock_set();
+}
+
+
+// Seconds until the next timed wake: restart countdown, alarm or schedule.
+// Must be called with interrupts disabled.
+uint32_t board_next_event( void )
+{
+    uint32_t next = schedule_next( seconds );
+
+    if ( ( countdown != 0 ) && ( countdown < next ) )
+    {
+        next = countdown;
+    }
+    if ( alarm != 0 )
+    {
+        if ( alarm <= seconds )
+        {
+            next = 0;
+        }
+        else if ( alarm - seconds < next )
+        {
+            next = alarm - seconds;
+        }
+    }
+    return next;
+}
+
+
+// Switch timer2 between the 1 s tick and the long tick while off.  At
+// clk/1024 one count is 1/32 s and the overflow comes every
+// LONG_TICK_SECONDS, so the time counted so far carries over between the
+// two; leaving early loses what the prescaler held, under 1/32 s.  Only
+// enter with nothing due within LONG_TICK_SECONDS, so no event falls inside
+// a long tick.
+void board_set_long_tick( uint8_t enable )
+{
+    uint8_t t, s;
+
+    cli();
+    
+    // Let a pending overflow be counted at the rate it was made at
+    while ( TIFR2 & ( 1 << TOV2 ) )
+    {
+        sei();
+        asm volatile( "nop\n\t" );
+        cli();
+    }
+    
+    if ( enable != long_tick )
+    {
+        // TCNT2 reads stale until a TOSC1 cycle after power-save
+        while ( ASSR & ( 1 << TCR2AUB ) ) { /* wait */ }
+        TCCR2A = 0;
+        while ( ASSR & ( ( 1 << TCR2AUB ) | ( 1 << TCN2UB ) | ( 1 << TCR2BUB ) ) ) { /* wait */ }
+        t = TCNT2;
+        
+        if ( enable )
+        {
+            TCNT2 = t / LONG_TICK_SECONDS;
+            TCCR2B = ( 1 << CS22 ) | ( 1 << CS21 ) | ( 1 << CS20 );    // clk/1024 (8s)
+        }
+        else
+        {
+            s = t / 32;
+            seconds += s;
+            registers_set_seconds( seconds );
+            if ( countdown != 0 )
+            {
+                countdown = ( countdown > s ) ? countdown - s : 1;
+            }
+            TCNT2 = ( t % 32 ) * LONG_TICK_SECONDS;
+            TCCR2B = ( 1 << CS22 ) | ( 1 << CS20 );    // clk/128 (1s)
+        }
+        long_tick = enable;
+    }
+    
+    sei();
+}
+
+
+// Arm the wake-up alarm, 0 disables it.  The alarm fires once when the
+// RTC reaches it, whatever the power state.
+void board_set_alarm( uint32_t value )
+{
+    alarm = value;
+    if ( value != 0 )
+    {
+        registers_set_mask( REG_START_ENABLE, START_ALARM );
+    }
+}
+
+
 void board_power_on( void )
 {
     PORTD |= PIN_D;
@@ -147,6 +290,34 @@ uint8_t board_3v3( void )
 }
 
 
+// VCC in mV from a conversion of the bandgap against AVCC.  The ADC is
+// only powered for the measurement; the first conversion covers the
+// bandgap settling time and is discarded.
+uint16_t board_read_vcc( void )
+{
+    uint16_t adc;
+    uint8_t i;
+
+    PRR &= ~( 1 << PRADC );
+    ADMUX = ( 1 << REFS0 ) | ( 1 << MUX3 ) | ( 1 << MUX2 ) | ( 1 << MUX1 );    // AVCC ref, 1.1V bandgap
+    ADCSRA = ( 1 << ADEN ) | ( 1 << ADPS2 ) | ( 1 << ADPS1 );                  // clk/64, 125kHz
+    for ( i = 0; i < 2; i++ )
+    {
+        ADCSRA |= ( 1 << ADSC );
+        while ( ADCSRA & ( 1 << ADSC ) ) { /* wait */ }
+    }
+    adc = ADC;
+    ADCSRA = 0;
+    PRR |= ( 1 << PRADC );
+
+    if ( adc == 0 )
+    {
+        return 0xFFFF;
+    }
+    return ( 1100UL * 1024 ) / adc;
+}
+
+
 void board_hold_reset( void )
 {
     if ( registers_get( REG_BOARD_TYPE ) == BOARD_TYPE_BONE )
@@ -301,9 +472,65 @@ void board_gpio_config( void )
 }
 
 
+// Restart the debounce period.  timer0 is only powered while it runs.
+static void debounce_start( void )
+{
+    PRR &= ~( 1 << PRTIM0 );
+    TCCR0B = 0;
+    TCNT0 = 0;
+    OCR0A = DEBOUNCE_COUNT;
+    TCCR0A = ( 1 << WGM01 );                    // CTC
+    TIFR0 = ( 1 << OCF0A );
+    TIMSK0 = ( 1 << OCIE0A );
+    TCCR0B = ( 1 << CS02 ) | ( 1 << CS00 );    // clk/1024
+}
+
+
+static void debounce_stop( void )
+{
+    TCCR0B = 0;
+    TIMSK0 = 0;
+    PRR |= ( 1 << PRTIM0 );
+}
+
+
+// While the host is up the button and opto pin changes only wake the main
+// loop, which sleeps in between, and a button change is reported through
+// button_settled once it has been stable for the debounce period.
+void board_set_running( uint8_t enable )
+{
+    running = enable;
+    if ( enable )
+    {
+        PCMSK0 |= ( PIN_OPTO );
+        PCMSK2 |= ( PIN_BUTTON );
+        PCICR  |= ( 1 << PCIE0 ) | ( 1 << PCIE2 );
+        debounce_start();
+    }
+    else
+    {
+        board_disable_interrupt( START_EXTERNAL | START_BUTTON );
+        debounce_stop();
+        button_settled = 0;
+    }
+}
+
+
+ISR( TIMER0_COMPA_vect, ISR_BLOCK )
+{
+    debounce_stop();
+    button_settled = 1;
+}
+
+
 // OPTO
 ISR( PCINT0_vect, ISR_BLOCK )
 {
+    if ( running )
+    {
+        return;
+    }
+
     PCMSK0 &= ~PIN_OPTO;
 
     if ( ( PINB & PIN_OPTO ) == 0 )
@@ -313,13 +540,21 @@ ISR( PCINT0_vect, ISR_BLOCK )
 }
 
 
-// Power Good oscillation fix
+// Power Good oscillation fix.  Logged at most once a minute, since CE is
+// re-enabled every tick.
 ISR( PCINT1_vect, ISR_BLOCK )
 {
+    static uint32_t last_trip;
+    
     if ( ( PINC & PIN_PGOOD ) == 0 )
     {
         PCMSK1 &= ~PIN_PGOOD;
         board_ce( 0 );
+        if ( ( last_trip == 0 ) || ( seconds - last_trip >= 60 ) )
+        {
+            last_trip = seconds;
+            event_log( EVENT_PGOOD_TRIP, 0 );
+        }
     }
 }
 
@@ -327,6 +562,12 @@ ISR( PCINT1_vect, ISR_BLOCK )
 // Button
 ISR( PCINT2_vect, ISR_BLOCK )
 {
+    if ( running )
+    {
+        debounce_start();
+        return;
+    }
+
     if ( ( PIND & PIN_BUTTON ) == 0 )
     {
         PCMSK2 &= ~PIN_BUTTON;
@@ -338,29 +579,63 @@ ISR( PCINT2_vect, ISR_BLOCK )
 ISR( TIMER2_OVF_vect, ISR_BLOCK )
 {
     static uint8_t button_hold_count = 0;
+    uint8_t step = long_tick ? LONG_TICK_SECONDS : 1;
     
     // Handle RTC
     system_ticks++;
 #ifdef DEBUG
     //PORTB ^= PIN_LED0;
 #endif
-    seconds++;
+    seconds += step;
+    registers_set_seconds( seconds );
+    
+    // Drift correction: a second one count short skips ahead, a second one
+    // count long repeats count 0 from the compare match on count 1.  A long
+    // tick count is worth step short ones.
+    if ( rtc_trim != 0 )
+    {
+        trim_acc += 2 * (int32_t)rtc_trim * step;
+        if ( trim_acc >= TRIM_COUNT * step )
+        {
+            trim_acc -= TRIM_COUNT * step;
+            while ( ASSR & ( 1 << TCN2UB ) ) { /* wait */ }
+            TCNT2 = 1;
+        }
+        else if ( trim_acc <= -TRIM_COUNT * step )
+        {
+            trim_acc += TRIM_COUNT * step;
+            TIFR2 = ( 1 << OCF2B );
+            TIMSK2 |= ( 1 << OCIE2B );
+        }
+    }
     
     // Check for startup conditions
+    if ( ( alarm != 0 ) && ( seconds >= alarm ) )
+    {
+        alarm = 0;
+        registers_set( REG_ALARM_0, 0 );
+        registers_set( REG_ALARM_1, 0 );
+        registers_set( REG_ALARM_2, 0 );
+        registers_set( REG_ALARM_3, 0 );
+        power_event( START_ALARM );
+    }
+    schedule_tick( seconds );
+    
     if ( countdown != 0 )
     {
-        countdown--;
+        countdown = ( countdown > step ) ? countdown - step : 0;
         if ( countdown == 0 )
         {
             power_event( START_TIMEOUT );
         }
     }
     
-    // Forced power-off check
+    // Power-off check: a 5 s hold asks the host to shut down, holding
+    // for another 5 s cuts the power
     if ( ( PIND & PIN_BUTTON ) == 0 )
     {
         button_hold_count++;
-        if ( button_hold_count == 5 )
+        if ( ( button_hold_count == 5 ) || ( button_hold_count == 10 ) )
         {
             power_down();
         }
@@ -372,6 +647,14 @@ ISR( TIMER2_OVF_vect, ISR_BLOCK )
 }
 
 
+ISR( TIMER2_COMPB_vect, ISR_BLOCK )
+{
+    while ( ASSR & ( 1 << TCN2UB ) ) { /* wait */ }
+    TCNT2 = 0;
+    TIMSK2 &= ~( 1 << OCIE2B );
+}
+
+
 void timer2_init( void )
 {
     PRR &= ~( 1 << PRTIM2 );    // is this necessary with async mode?
@@ -379,6 +662,7 @@ void timer2_init( void )
     TCCR2B = 0;
     TCCR2A = 0;
     TCNT2 = 0;
+    OCR2B = 1;                  // drift correction point
     TCCR2B = ( 1 << CS22 ) | ( 1 << CS20 );    // clk/128 (1s)
     TIMSK2 = ( 1 << TOIE2 );
 }
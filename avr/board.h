@@ -50,7 +50,17 @@ __asm__ __volatile__ (  \
 void timer0_init( void );
 void timer1_init( void );
 
+// Timer2 overflow period at clk/1024, used while off with nothing due
+#define LONG_TICK_SECONDS   8
+
+void board_set_running( uint8_t enable );
+uint32_t board_next_event( void );
+void board_set_long_tick( uint8_t enable );
+
 uint8_t board_begin_countdown( void );
+uint32_t board_get_rtc( uint8_t *fraction );
+void board_set_rtc( uint32_t value );
+void board_set_alarm( uint32_t value );
 
 void board_power_on( void );
 void board_power_off( void );
@@ -64,6 +74,7 @@ void board_set_pwrbut( int enable );
 void board_ce( uint8_t enable );
 
 uint8_t board_3v3( void );
+uint16_t board_read_vcc( void );
 uint8_t board_pgood( void );
 void board_hold_reset( void );
 void board_release_reset( void );
@@ -3,7 +3,20 @@
 #include <stdio.h>
 #include <avr/io.h>
 #include <avr/eeprom.h>
+#include <avr/interrupt.h>
 #include "eeprom.h"
+#include "registers.h"
+
+
+typedef struct
+{
+    uint8_t *address;
+    uint8_t value;
+} eeprom_write_type;
+
+static eeprom_write_type queue[ EEPROM_QUEUE_SIZE ];
+static uint8_t queue_head;
+static volatile uint8_t queue_count;
 
 
 void eeprom_set_bootloader_flag( void )
@@ -47,19 +60,100 @@ uint8_t eeprom_get_stepping_value( void )
 }
 
 
-uint8_t eeprom_get_i2c_address( void )
+// Goes through the deferred queue; call with interrupts disabled
+void eeprom_set_rtc_trim( int16_t value )
+{
+    eeprom_queue_byte( (uint8_t*)EEPROM_RTC_TRIM, (uint16_t)value & 0xFF );
+    eeprom_queue_byte( (uint8_t*)EEPROM_RTC_TRIM + 1, (uint16_t)value >> 8 );
+}
+
+
+int16_t eeprom_get_rtc_trim( void )
 {
-    return eeprom_read_byte( EEPROM_I2C_ADDR );
+    uint16_t value = eeprom_read_word( EEPROM_RTC_TRIM );
+
+    // Erased EEPROM means no correction
+    return ( value == 0xFFFF ) ? 0 : (int16_t)value;
 }
 
 
-uint8_t eeprom_get_charge_current( void )
+// Deferred writes
+//
+// A byte write takes about 3.4 ms, too long to spend in the TWI ISR, so
+// the ISR queues it here and the main loop starts one write whenever the
+// EEPROM is idle.  REG_EEPROM_STATUS shows whether writes are outstanding
+// and whether one had to be dropped.
+
+// Called from the TWI ISR.  A queued write to the same address is replaced
+// rather than repeated.
+void eeprom_queue_byte( uint8_t *address, uint8_t value )
 {
-    return eeprom_read_byte( EEPROM_CHG_CURRENT );
+    uint8_t i, slot;
+
+    for ( i = 0; i < queue_count; i++ )
+    {
+        slot = ( queue_head + i ) % EEPROM_QUEUE_SIZE;
+        if ( queue[ slot ].address == address )
+        {
+            queue[ slot ].value = value;
+            return;
+        }
+    }
+
+    if ( queue_count == EEPROM_QUEUE_SIZE )
+    {
+        registers_set_mask( REG_EEPROM_STATUS, EEPROM_STATUS_OVERFLOW );
+        return;
+    }
+
+    slot = ( queue_head + queue_count ) % EEPROM_QUEUE_SIZE;
+    queue[ slot ].address = address;
+    queue[ slot ].value = value;
+    queue_count++;
+    registers_set_mask( REG_EEPROM_STATUS, EEPROM_STATUS_BUSY );
 }
 
 
-uint8_t eeprom_get_charge_timer( void )
+// Main loop: start the next write if the EEPROM is free, never wait
+void eeprom_queue_service( void )
 {
-    return eeprom_read_byte( EEPROM_CHG_TIMER );
+    eeprom_write_type w;
+
+    if ( !eeprom_is_ready() )
+    {
+        return;
+    }
+
+    cli();
+    if ( queue_count == 0 )
+    {
+        registers_clear_mask( REG_EEPROM_STATUS, EEPROM_STATUS_BUSY );
+        sei();
+        return;
+    }
+    w = queue[ queue_head ];
+    queue_head = ( queue_head + 1 ) % EEPROM_QUEUE_SIZE;
+    queue_count--;
+    sei();
+
+    eeprom_update_byte( w.address, w.value );
+}
+
+
+// Writes queued or still being programmed
+uint8_t eeprom_queue_pending( void )
+{
+    return ( queue_count != 0 ) || !eeprom_is_ready();
+}
+
+
+// Finish everything outstanding, e.g. before a reset
+void eeprom_queue_flush( void )
+{
+    while ( queue_count != 0 )
+    {
+        eeprom_busy_wait();
+        eeprom_queue_service();
+    }
+    eeprom_busy_wait();
 }
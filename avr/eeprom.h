@@ -9,17 +9,28 @@
 #define EEPROM_I2C_ADDR     ( (uint8_t*)5 )
 #define EEPROM_CHG_CURRENT  ( (uint8_t*)6 )
 #define EEPROM_CHG_TIMER    ( (uint8_t*)7 )
+#define EEPROM_RTC_TRIM     ( (uint16_t*)8 )
+#define EEPROM_SCHEDULE     ( (void*)16 )      // SCHEDULE_SIZE bytes
+#define EEPROM_VCC_CUTOFF   ( (uint8_t*)80 )
+#define EEPROM_VCC_RESTART  ( (uint8_t*)81 )
+#define EEPROM_SHUTDOWN     ( (uint8_t*)82 )
+#define EEPROM_EVENTS       ( (void*)512 )     // EVENT_SLOTS records
 
 #define EE_FLAG_LOADER      0x01
 
+#define EEPROM_QUEUE_SIZE   8           // Pending byte writes
+
 void eeprom_set_bootloader_flag( void );
 void eeprom_set_calibration_value( uint8_t value );
 uint8_t eeprom_get_calibration_value( void );
 uint8_t eeprom_get_board_type( void );
 uint8_t eeprom_get_revision_value( void );
 uint8_t eeprom_get_stepping_value( void );
-uint8_t eeprom_get_i2c_address( void );
-uint8_t eeprom_get_charge_current( void );
-uint8_t eeprom_get_charge_timer( void );
+void eeprom_set_rtc_trim( int16_t value );
+int16_t eeprom_get_rtc_trim( void );
+void eeprom_queue_byte( uint8_t *address, uint8_t value );
+void eeprom_queue_service( void );
+void eeprom_queue_flush( void );
+uint8_t eeprom_queue_pending( void );
 
 #endif  // __EEPROM_H__
@@ -0,0 +1,173 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include "eeprom.h"
+#include "board.h"
+#include "events.h"
+
+
+#define EVENT_SLOT( seq )   ( (event_record_type*)EEPROM_EVENTS + ( ( seq ) % EVENT_SLOTS ) )
+
+static event_record_type ram[ EVENT_RAM ];
+static volatile uint16_t next_seq;      // Sequence number of the next event
+static volatile uint16_t read_seq;      // Oldest event the host has not read
+static volatile uint16_t spill_seq;     // Oldest event not yet in EEPROM
+static uint8_t position;
+static event_record_type spilling;      // Event being copied to EEPROM
+static uint8_t spill_position = sizeof( event_record_type );
+
+
+static uint8_t slot_read( uint16_t seq, event_record_type *r )
+{
+    eeprom_read_block( r, EVENT_SLOT( seq ), sizeof( *r ) );
+    return ( r->type != 0xFF ) && ( ( r->seq % EVENT_SLOTS ) == ( seq % EVENT_SLOTS ) );
+}
+
+
+// Find the newest record in EEPROM and reload the ones before it
+void events_init( void )
+{
+    event_record_type r;
+    uint16_t newest = 0;
+    uint8_t i, found = 0;
+
+    for ( i = 0; i < EVENT_SLOTS; i++ )
+    {
+        if ( slot_read( i, &r ) && ( !found || (int16_t)( r.seq - newest ) > 0 ) )
+        {
+            newest = r.seq;
+            found = 1;
+        }
+    }
+
+    next_seq = found ? newest + 1 : 0;
+    spill_seq = next_seq;
+    read_seq = next_seq;
+    for ( i = 0; found && ( i < EVENT_RAM ); i++ )
+    {
+        if ( !slot_read( newest - i, &r ) || ( r.seq != (uint16_t)( newest - i ) ) )
+        {
+            break;
+        }
+        ram[ r.seq % EVENT_RAM ] = r;
+        read_seq--;
+    }
+}
+
+
+// Called from ISRs as well as the main loop.  When the ring is full the
+// oldest event goes, read or not.
+void event_log( uint8_t type, uint8_t data )
+{
+    event_record_type *r;
+    uint8_t frac;
+    uint8_t sreg = SREG;
+
+    cli();
+    r = &ram[ next_seq % EVENT_RAM ];
+    r->time = board_get_rtc( &frac );
+    r->type = type;
+    r->data = data;
+    r->seq = next_seq++;
+
+    if ( (uint16_t)( next_seq - read_seq ) > EVENT_RAM )
+    {
+        read_seq = next_seq - EVENT_RAM;
+        position = 0;
+    }
+    if ( (uint16_t)( next_seq - spill_seq ) > EVENT_RAM )
+    {
+        spill_seq = next_seq - EVENT_RAM;
+    }
+    SREG = sreg;
+}
+
+
+// Main loop, every pass: start at most one byte write, and only when the
+// EEPROM is idle and no host write is queued, so nothing waits on it.  The
+// sequence number is the last field, so a torn record does not look like
+// the newest.
+void events_service( void )
+{
+    if ( eeprom_queue_pending() )
+    {
+        return;
+    }
+
+    if ( spill_position == sizeof( spilling ) )
+    {
+        cli();
+        if ( spill_seq == next_seq )
+        {
+            sei();
+            return;
+        }
+        spilling = ram[ spill_seq % EVENT_RAM ];
+        spill_seq++;
+        sei();
+        spill_position = 0;
+    }
+
+    eeprom_update_byte( (uint8_t*)EVENT_SLOT( spilling.seq ) + spill_position,
+                        ( (uint8_t*)&spilling )[ spill_position ] );
+    spill_position++;
+}
+
+
+// Events not yet in EEPROM
+uint8_t events_pending( void )
+{
+    uint8_t pending;
+    uint8_t sreg = SREG;
+
+    cli();
+    pending = ( spill_position != sizeof( spilling ) ) || ( spill_seq != next_seq );
+    SREG = sreg;
+    return pending;
+}
+
+
+// Everything to EEPROM, before the bootloader takes over
+void events_flush( void )
+{
+    while ( events_pending() )
+    {
+        eeprom_busy_wait();
+        events_service();
+    }
+    eeprom_busy_wait();
+}
+
+
+// REG_EVENT_COUNT, called from the TWI ISR
+uint8_t events_unread( void )
+{
+    return next_seq - read_seq;
+}
+
+
+// REG_EVENT_FIFO port, called from the TWI ISR
+void events_host_select( void )
+{
+    position = 0;
+}
+
+
+uint8_t events_host_read( void )
+{
+    uint8_t data;
+
+    if ( read_seq == next_seq )
+    {
+        return 0xFF;
+    }
+
+    data = ( (uint8_t*)&ram[ read_seq % EVENT_RAM ] )[ position++ ];
+    if ( position == sizeof( event_record_type ) )
+    {
+        position = 0;
+        read_seq++;
+    }
+    return data;
+}
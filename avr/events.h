@@ -0,0 +1,46 @@
+#ifndef __EVENTS_H__
+#define __EVENTS_H__
+
+// Event log
+//
+// Power and watchdog events are timestamped into an SRAM ring of the last
+// EVENT_RAM events.  The main loop copies them a byte at a time, whenever
+// the EEPROM is idle, to a ring of EVENT_SLOTS records in EEPROM, so a
+// slot is only rewritten every EVENT_SLOTS events.  At reset the newest records are loaded back and
+// offered to the host again; sequence numbers show repeats and gaps.
+//
+// The host drains unread events, oldest first, through the REG_EVENT_FIFO
+// port.  A record is consumed when its last byte is read, selecting the
+// register restarts a partly read record, and an empty log reads 0xFF.
+
+#define EVENT_RAM           16
+#define EVENT_SLOTS         64          // EEPROM records, a power of two
+
+// Event types, data in brackets
+#define EVENT_RESET         0x01        // AVR reset (MCUSR)
+#define EVENT_WAKE          0x02        // Power-up (START_* reason, 0 for a watchdog power cycle)
+#define EVENT_POWER_DOWN    0x03        // Power-down (SHUTDOWN_* outcome)
+#define EVENT_POWER_FAIL    0x04        // 3V3 did not come up (attempts)
+#define EVENT_WATCHDOG      0x05        // Watchdog expired (its REG_WDT_* index)
+#define EVENT_PGOOD_TRIP    0x06        // PGOOD dropped, charger disabled
+#define EVENT_LOW_SUPPLY    0x07        // Supply under cutoff (supply in 20 mV units)
+#define EVENT_BOOTLOADER    0x08        // Bootloader entry
+
+typedef struct {
+    uint32_t time;          // RTC seconds
+    uint8_t type;           // EVENT_*, 0xFF in an erased slot
+    uint8_t data;
+    uint16_t seq;           // Sequence number, written to EEPROM last
+} event_record_type;
+
+void events_init( void );
+void event_log( uint8_t type, uint8_t data );
+void events_service( void );
+uint8_t events_pending( void );
+void events_flush( void );
+
+uint8_t events_unread( void );
+void events_host_select( void );
+uint8_t events_host_read( void );
+
+#endif  // __EVENTS_H__
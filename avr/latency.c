@@ -0,0 +1,126 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "registers.h"
+#include "board.h"
+#include "latency.h"
+
+
+static latency_record_type ring[ LATENCY_HISTORY ];
+static uint8_t head;
+static uint8_t position;
+static volatile uint8_t waiting;
+
+
+// Time since the wake event of the newest record.  Must be called with
+// interrupts disabled.
+static uint16_t since_wake( void )
+{
+    uint8_t frac;
+    uint32_t s = board_get_rtc( &frac );
+    int32_t t;
+
+    // The RTC was set back since
+    if ( s < ring[ head ].wake )
+    {
+        return LATENCY_NONE;
+    }
+    if ( s - ring[ head ].wake > 255 )
+    {
+        return LATENCY_NONE - 1;
+    }
+    t = (int32_t)( s - ring[ head ].wake ) * 256 + frac - ring[ head ].wake_frac;
+    return ( t < LATENCY_NONE ) ? t : LATENCY_NONE - 1;
+}
+
+
+static void mirror( void )
+{
+    registers_set( REG_LATENCY_RAIL_0, ring[ head ].rail & 0xFF );
+    registers_set( REG_LATENCY_RAIL_1, ring[ head ].rail >> 8 );
+    registers_set( REG_LATENCY_HOST_0, ring[ head ].host & 0xFF );
+    registers_set( REG_LATENCY_HOST_1, ring[ head ].host >> 8 );
+    registers_set( REG_LATENCY_ATTEMPTS, ring[ head ].attempts );
+}
+
+
+// A wake event starts a power-up.  Called from pin change and timer ISRs
+// and from the state machine.
+void latency_wake( uint8_t reason )
+{
+    latency_record_type *r;
+    uint8_t sreg = SREG;
+
+    cli();
+    head = ( head + 1 ) % LATENCY_HISTORY;
+    r = &ring[ head ];
+    r->wake = board_get_rtc( &r->wake_frac );
+    r->reason = reason;
+    r->attempts = 0;
+    r->reserved = 0;
+    r->rail = LATENCY_NONE;
+    r->host = LATENCY_NONE;
+    waiting = 0;
+    mirror();
+    SREG = sreg;
+}
+
+
+// State machine: 3V3 switched on again
+void latency_attempt( void )
+{
+    cli();
+    ring[ head ].attempts++;
+    mirror();
+    sei();
+}
+
+
+// State machine: 3V3 is up.  Not a power-up of ours if the host was
+// already running at reset.
+void latency_rail( void )
+{
+    if ( ring[ head ].attempts == 0 )
+    {
+        return;
+    }
+    
+    cli();
+    ring[ head ].rail = since_wake();
+    waiting = 1;
+    mirror();
+    sei();
+}
+
+
+// TWI ISR, on every host access
+void latency_access( void )
+{
+    if ( waiting )
+    {
+        waiting = 0;
+        ring[ head ].host = since_wake();
+        mirror();
+    }
+}
+
+
+// REG_LATENCY_HISTORY port, called from the TWI ISR.  Selecting the
+// register rewinds it to the newest record.
+void latency_host_select( void )
+{
+    position = 0;
+}
+
+
+uint8_t latency_host_read( void )
+{
+    uint8_t i;
+
+    if ( position < LATENCY_SIZE )
+    {
+        i = ( head + LATENCY_HISTORY - position / sizeof( latency_record_type ) ) % LATENCY_HISTORY;
+        return ( (uint8_t*)&ring[ i ] )[ position++ % sizeof( latency_record_type ) ];
+    }
+    return 0xFF;
+}
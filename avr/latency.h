@@ -0,0 +1,36 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+// Power-up latency
+//
+// Every power-up gets a record in a small ring: when the wake event came
+// and what it was, how many power-up attempts it took, and how long it
+// was until 3V3 was up and until the host first talked to us.  Times come
+// from the RTC with its 1/256 s fraction.  Durations are in 1/256 s, with
+// LATENCY_NONE for a stage not reached.  The newest record is mirrored in
+// the REG_LATENCY_* registers and the host reads the ring, newest first,
+// through the REG_LATENCY_HISTORY port.
+
+#define LATENCY_HISTORY     8
+#define LATENCY_NONE        0xFFFF
+#define LATENCY_SIZE        ( LATENCY_HISTORY * sizeof( latency_record_type ) )
+
+typedef struct {
+    uint32_t wake;          // RTC seconds of the wake event, 0 if unused
+    uint8_t wake_frac;      // Fraction of that second in 1/256 s
+    uint8_t reason;         // START_* bit, 0 for a watchdog power cycle
+    uint8_t attempts;       // Power-up attempts made
+    uint8_t reserved;
+    uint16_t rail;          // Wake to 3V3 up
+    uint16_t host;          // Wake to the first host access
+} latency_record_type;
+
+void latency_wake( uint8_t reason );
+void latency_attempt( void );
+void latency_rail( void );
+void latency_access( void );
+
+void latency_host_select( void );
+uint8_t latency_host_read( void );
+
+#endif  // __LATENCY_H__
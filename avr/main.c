@@ -13,9 +13,16 @@
 #include "registers.h"
 #include "twi_slave.h"
 #include "bb_i2c.h"
+#include "schedule.h"
+#include "supply.h"
+#include "latency.h"
+#include "events.h"
 
 
 extern volatile uint16_t system_ticks;
+extern volatile uint32_t seconds;
+extern volatile int16_t rtc_trim;
+extern volatile uint8_t button_settled;
 volatile uint8_t rebootflag = 0;
 volatile uint8_t activity_watchdog;
 uint8_t ce_countdown = 0;
@@ -39,19 +46,37 @@ enum state_type {
     STATE_POWER_UP,
     STATE_CHECK_3V,
     STATE_ON,
+    STATE_SHUTDOWN,
+    STATE_SHUTDOWN_WAIT,
     STATE_POWER_DOWN,
     STATE_WDT_POWER,
 };
 
 volatile uint8_t power_state = STATE_INIT;
 uint8_t retries = 0;
+uint8_t shutdown_countdown = 0;
 
 
+// The host is off, one way or another
+void power_down_done( uint8_t outcome )
+{
+    registers_set( REG_SHUTDOWN_STATUS, outcome );
+    event_log( EVENT_POWER_DOWN, outcome );
+    power_state = STATE_POWER_DOWN;
+}
+
+
+// Ask the host to shut down.  Asked again while it is shutting down, the
+// power is cut straight away.
 void power_down( void )
 {
     if ( power_state == STATE_ON )
     {
-        power_state = STATE_POWER_DOWN;
+        power_state = STATE_SHUTDOWN;
+    }
+    else if ( power_state == STATE_SHUTDOWN_WAIT )
+    {
+        power_down_done( SHUTDOWN_FORCED );
     }
 }
 
@@ -60,11 +85,24 @@ void power_event( uint8_t reason )
 {
     if ( ( power_state == STATE_OFF_NO_PGOOD ) || ( power_state == STATE_OFF_WITH_PGOOD ) )
     {
-        if ( registers_get( REG_START_ENABLE ) & reason )
+        reason &= registers_get( REG_START_ENABLE );
+
+        // Not enough left to finish booting.  The wake goes through once the
+        // supply recovers, and the pins stay armed meanwhile.
+        if ( reason && supply_low() )
+        {
+            supply_hold_wake( reason );
+            board_enable_interrupt( reason );
+            return;
+        }
+        
+        if ( reason )
         {
             retries = 3;
             power_state = STATE_POWER_UP;
             registers_set_mask( REG_START_REASON, reason );
+            latency_wake( reason );
+            event_log( EVENT_WAKE, reason );
         }
     }
 }
@@ -92,6 +130,7 @@ void watchdog_check( void )
         registers_set( REG_WDT_RESET, i );
         if ( i == 0 )
         {
+            event_log( EVENT_WATCHDOG, REG_WDT_RESET );
             watchdog_reset();
             registers_set( REG_WDT_POWER, 0 );
             registers_set( REG_WDT_STOP, 0 );
@@ -106,6 +145,7 @@ void watchdog_check( void )
         registers_set( REG_WDT_POWER, i );
         if ( i == 0 )
         {
+            event_log( EVENT_WATCHDOG, REG_WDT_POWER );
             power_state = STATE_WDT_POWER;
         }
     }
@@ -118,7 +158,8 @@ void watchdog_check( void )
         registers_set( REG_WDT_STOP, i );
         if ( i == 0 )
         {
-            power_state = STATE_POWER_DOWN;
+            event_log( EVENT_WATCHDOG, REG_WDT_STOP );
+            power_down();
         }
     }
     
@@ -128,6 +169,7 @@ void watchdog_check( void )
         activity_watchdog -= 1;
         if ( activity_watchdog == 0 )
         {
+            event_log( EVENT_WATCHDOG, REG_WDT_START );
             power_state = STATE_WDT_POWER;
         }
     }
@@ -147,6 +189,49 @@ void check_ce_reenable( void )
 }
 
 
+// Power-save until the next tick or pin change.  With no timed event due
+// for a while timer2 switches to the long tick, and the watchdog, which
+// would not outlast it, is stopped meanwhile.  Waiting for PGOOD is done by
+// polling, so it keeps the 1 s tick when PGOOD is a start source.
+void off_sleep( void )
+{
+    uint8_t slow;
+    
+    cli();
+    slow = ( ce_countdown == 0 ) && ( board_next_event() > LONG_TICK_SECONDS );
+    sei();
+    if ( ( power_state == STATE_OFF_NO_PGOOD ) &&
+         ( registers_get( REG_START_ENABLE ) & START_PWRGOOD ) )
+    {
+        slow = 0;
+    }
+    
+    if ( slow )
+    {
+        wdt_disable();
+        board_set_long_tick( 1 );
+    }
+    
+    while ( ASSR & ( ( 1 << TCR2AUB ) | ( 1 << TCR2BUB ) | ( 1 << TCN2UB ) ) ) { /* wait */ }
+    cli();
+    if ( ( power_state == STATE_OFF_NO_PGOOD ) || ( power_state == STATE_OFF_WITH_PGOOD ) )
+    {
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+    sei();
+    TCCR2A = 0;
+    
+    if ( slow )
+    {
+        board_set_long_tick( 0 );
+        wdt_enable( WDTO_2S );
+    }
+}
+
+
 void state_machine( void )
 {
     switch( power_state )
@@ -195,14 +280,6 @@ void state_machine( void )
                 power_state = STATE_OFF_WITH_PGOOD;
                 power_event( START_PWRGOOD );
             }
-            else
-            {
-                while ( ASSR & ( 1 << TCR2AUB ) ) { /* wait */ }
-                sleep_enable();
-                sleep_cpu();
-                sleep_disable();
-                TCCR2A = 0;
-            }
             break;
         }
         
@@ -214,20 +291,13 @@ void state_machine( void )
             {
                 power_state = STATE_OFF_NO_PGOOD;
             }
-            else
-            {
-                while ( ASSR & ( 1 << TCR2AUB ) ) { /* wait */ }
-                sleep_enable();
-                sleep_cpu();
-                sleep_disable();
-                TCCR2A = 0;
-            }
             break;
         }
         
         case STATE_POWER_UP:
         {
             retries--;
+            latency_attempt();
 
             board_set_pwrbut( 0 );
             registers_set( REG_WDT_RESET, 0 );
@@ -253,8 +323,10 @@ void state_machine( void )
             if ( board_3v3() )
             {
                 power_state = STATE_ON;
+                latency_rail();
                 twi_slave_init();
                 board_disable_interrupt( START_ALL );
+                board_set_running( 1 );
                 activity_watchdog = registers_get( REG_WDT_START );
             }
             else
@@ -266,6 +338,7 @@ void state_machine( void )
                 }
                 else
                 {
+                    event_log( EVENT_POWER_FAIL, 3 );
                     power_state = STATE_POWER_DOWN;
                 }
             }
@@ -276,13 +349,49 @@ void state_machine( void )
         {
             if ( board_3v3() == 0 )
             {
-                power_state = STATE_POWER_DOWN;
+                power_down_done( SHUTDOWN_HOST );
+            }
+            else if ( supply_low() )
+            {
+                power_state = STATE_SHUTDOWN;
+            }
+            break;
+        }
+        
+        // Press PWR_BUT for a tick so the OS shuts down, then give it
+        // REG_SHUTDOWN_TIMEOUT seconds to drop 3V3 before cutting power
+        case STATE_SHUTDOWN:
+        {
+            shutdown_countdown = registers_get( REG_SHUTDOWN_TIMEOUT );
+            if ( shutdown_countdown == 0 )
+            {
+                power_down_done( SHUTDOWN_FORCED );
+            }
+            else
+            {
+                board_set_pwrbut( 1 );
+                power_state = STATE_SHUTDOWN_WAIT;
+            }
+            break;
+        }
+        
+        case STATE_SHUTDOWN_WAIT:
+        {
+            board_set_pwrbut( 0 );
+            if ( board_3v3() == 0 )
+            {
+                power_down_done( SHUTDOWN_CLEAN );
+            }
+            else if ( --shutdown_countdown == 0 )
+            {
+                power_down_done( SHUTDOWN_TIMEOUT );
             }
             break;
         }
         
         case STATE_POWER_DOWN:
         {
+            board_set_running( 0 );
             twi_slave_stop();
             board_power_off();
             power_state = STATE_CLEAR_MASK;
@@ -291,10 +400,13 @@ void state_machine( void )
         
         case STATE_WDT_POWER:
         {
+            board_set_running( 0 );
             twi_slave_stop();
             board_power_off();
             retries = 3;
             power_state = STATE_POWER_UP;
+            latency_wake( 0 );
+            event_log( EVENT_WAKE, 0 );
             break;
         }
     }
@@ -315,7 +427,9 @@ void check_charge_enable( void )
 int main( void )
 {
     uint8_t oscval;
+    int16_t trim;
     uint16_t last_tick = 0;
+    uint32_t now;
     
     // Make sure DIV8 is not selected
     if ( CLKPR != 0 )    // Div1
@@ -327,7 +441,10 @@ int main( void )
     // Platform setup
     board_init();
     registers_init();
+    schedule_init();
+    events_init();
     registers_set( REG_MCUSR, mcusr );
+    event_log( EVENT_RESET, mcusr );
     
     oscval = eeprom_get_calibration_value();
     if ( oscval != 0xFF )
@@ -339,6 +456,7 @@ int main( void )
         oscval = OSCCAL;
     }
     registers_set( REG_OSCCAL, oscval );
+    rtc_trim = registers_get( REG_RTC_TRIM_0 ) | ( registers_get( REG_RTC_TRIM_1 ) << 8 );
     
     set_sleep_mode( SLEEP_MODE_PWR_SAVE );
     sei();
@@ -355,6 +473,10 @@ int main( void )
         if ( last_tick != system_ticks )
         {
             last_tick = system_ticks;
+            cli();
+            now = seconds;
+            sei();
+            supply_check( now );
             state_machine();
             if ( power_state == STATE_ON )
             {
@@ -364,11 +486,13 @@ int main( void )
             check_charge_enable();
         }
         
-        if ( ( registers_get( REG_CONTROL ) & CONTROL_BUTTON_PWR_PASS ) && 
-             ( power_state == STATE_ON ) )
+        // Button edges are debounced on timer0 while running
+        if ( button_settled )
         {
-            _delay_ms( 1 );
-            if ( board_get_button() != board_get_pwrbut() )
+            button_settled = 0;
+            if ( ( registers_get( REG_CONTROL ) & CONTROL_BUTTON_PWR_PASS ) &&
+                 ( power_state == STATE_ON ) &&
+                 ( board_get_button() != board_get_pwrbut() ) )
             {
                 board_set_pwrbut( board_get_button() );
             }
@@ -377,8 +501,12 @@ int main( void )
         // Bootloader entry
         if ( rebootflag != 0 )
         {
+            event_log( EVENT_BOOTLOADER, 0 );
             twi_slave_stop();
             board_stop();
+            eeprom_queue_flush();
+            schedule_flush();
+            events_flush();
             eeprom_set_bootloader_flag();
             cli();
             wdt_enable( WDTO_30MS );
@@ -386,12 +514,56 @@ int main( void )
         }
         
         // Register handling
+        registers_commit();
+        registers_refresh();
+        
         if ( registers_get( REG_OSCCAL ) != oscval )
         {
             oscval = registers_get( REG_OSCCAL );
             eeprom_set_calibration_value( oscval );
             OSCCAL = oscval;
         }
+        
+        cli();
+        trim = registers_get( REG_RTC_TRIM_0 ) | ( registers_get( REG_RTC_TRIM_1 ) << 8 );
+        sei();
+        if ( trim != rtc_trim )
+        {
+            cli();
+            rtc_trim = trim;
+            eeprom_set_rtc_trim( trim );
+            sei();
+        }
+        
+        schedule_save();
+        eeprom_queue_service();
+        events_service();
+        
+        // Idle until the next TWI transfer, tick or button edge.  The off
+        // states power-save instead, but only once EEPROM writes are done:
+        // a write in progress keeps the clock running through power-save.
+        if ( ( power_state == STATE_ON ) || ( power_state == STATE_SHUTDOWN ) ||
+             ( power_state == STATE_SHUTDOWN_WAIT ) )
+        {
+            set_sleep_mode( SLEEP_MODE_IDLE );
+            cli();
+            if ( ( last_tick == system_ticks ) && ( rebootflag == 0 ) && !button_settled &&
+                 !registers_pending() && !schedule_pending() && !eeprom_queue_pending() &&
+                 !events_pending() )
+            {
+                sleep_enable();
+                sei();
+                sleep_cpu();
+                sleep_disable();
+            }
+            sei();
+            set_sleep_mode( SLEEP_MODE_PWR_SAVE );
+        }
+        else if ( ( ( power_state == STATE_OFF_NO_PGOOD ) || ( power_state == STATE_OFF_WITH_PGOOD ) ) &&
+                  ( last_tick == system_ticks ) && !eeprom_queue_pending() && !events_pending() )
+        {
+            off_sleep();
+        }
     }
 }
 
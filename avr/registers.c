@@ -1,11 +1,17 @@
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <avr/io.h>
 #include <avr/eeprom.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include "registers.h"
 #include "eeprom.h"
 #include "twi_slave.h"
 #include "board.h"
+#include "schedule.h"
+#include "latency.h"
+#include "events.h"
 
 
 extern volatile uint32_t seconds;
@@ -13,6 +19,8 @@ extern volatile uint8_t rebootflag;
 extern volatile uint8_t activity_watchdog;
 
 static uint8_t registers[ NUM_REGISTERS ];
+static volatile uint8_t pending[ ( NUM_REGISTERS + 7 ) / 8 ];
+static volatile uint8_t pending_any;
 
 // Internal interface
 void registers_set_mask( uint8_t index, uint8_t mask )
@@ -39,188 +47,463 @@ void registers_set( uint8_t index, uint8_t value )
 }
 
 
+// Timer2 ISR and RTC changes: keep the seconds registers current, so a
+// host read only copies bytes
+void registers_set_seconds( uint32_t value )
+{
+    memcpy( &registers[ REG_SECONDS_0 ], &value, sizeof( value ) );
+}
+
+
+// Register map
+//
+// One descriptor per register, in flash.  The host read and write paths
+// look up the descriptor for the byte and act on its access flags, so a
+// register is added by giving it an entry here and, if it needs one, a
+// hook.  Write hooks run after the value is stored.
+//
+// The register file doubles as the image the TWI ISR sends from: the main
+// loop keeps input-derived registers current with registers_refresh(),
+// and hooks that touch hardware are marked ACCESS_DEFER and run later
+// from registers_commit().  ACCESS_DEFER without a hook just wakes the
+// main loop for settings it applies itself.  Hooks left in the ISR only update the
+// register file or timer state and must stay in order with the bytes
+// around them.
+//
+// Multi-byte registers are read and written as a unit.  Reading the first
+// byte, or any byte of a different unit than the last one, snapshots the
+// whole unit and the rest of a burst reads from the snapshot.  Written
+// bytes are staged and land together when the last byte is written in
+// the same transaction; a new transaction drops anything still staged.  A
+// unit's write hook sees only that final byte.
+
+#define ACCESS_RO           0x01    // Host writes are ignored
+#define ACCESS_CLAMP        0x02    // Host writes are clamped to min..max
+#define ACCESS_RANGE        0x04    // Host writes outside min..max are ignored
+#define ACCESS_NOSTORE      0x08    // Host writes only go to the hook
+#define ACCESS_PORT         0x10    // Burst index stays on this register
+#define ACCESS_DEFER        0x20    // Write hook runs from the main loop
+
+// Byte offset and width of a multi-byte register, LSB first
+#define WIDE( offset, width )   ( ( ( offset ) << 4 ) | ( width ) )
+#define WIDE_OFFSET( w )        ( ( w ) >> 4 )
+#define WIDE_WIDTH( w )         ( ( w ) & 0x0F )
+#define WIDE_MAX                4
+
+typedef uint8_t (*register_read_hook)( uint8_t index );
+typedef void (*register_write_hook)( uint8_t index, uint8_t data );
+
+typedef struct
+{
+    uint8_t access;
+    uint8_t min;
+    uint8_t max;
+    uint8_t eeprom;                 // Backing EEPROM byte, 0 for none
+    uint8_t dflt;                   // Value when the EEPROM byte is erased
+    uint8_t wide;                   // WIDE() for multi-byte registers, else 0
+    register_read_hook read;
+    register_write_hook write;
+} register_desc_type;
+
+static uint8_t read_latch[ WIDE_MAX ];
+static uint8_t read_base = 0xFF;
+static uint8_t write_latch[ WIDE_MAX ];
+static uint8_t write_base = 0xFF;
+
+
+// The fraction is latched with the seconds.  TCNT2 is read before the
+// overflow flag, so a wrap not yet counted by the timer2 ISR reads as the
+// top of the old second rather than the start of it.  The host is only
+// served on the 1 s tick.
+static uint8_t read_seconds( uint8_t index )
+{
+    uint8_t t = TCNT2;
+
+    registers[ REG_SECONDS_FRAC ] = ( TIFR2 & ( 1 << TOV2 ) ) ? 0xFF : t;
+    return registers[ REG_SECONDS_0 ];
+}
+
+
+static uint8_t read_schedule( uint8_t index )
+{
+    return schedule_host_read();
+}
+
+
+static uint8_t read_latency( uint8_t index )
+{
+    return latency_host_read();
+}
+
+
+static uint8_t read_count( uint8_t index )
+{
+    return events_unread();
+}
+
+
+static uint8_t read_events( uint8_t index )
+{
+    return events_host_read();
+}
+
+
+static void write_control( uint8_t index, uint8_t data )
+{
+    if ( data & CONTROL_CE )
+    {
+        board_ce( 1 );
+    }
+    else
+    {
+        board_ce( 0 );
+    }
+    
+    if ( data & CONTROL_LED0 )
+    {
+        board_led_on( 0 );
+    }
+    else
+    {
+        board_led_off( 0 );
+    }
+
+    if ( data & CONTROL_LED1 )
+    {
+        board_led_on( 1 );
+    }
+    else
+    {
+        board_led_off( 1 );
+    }
+    
+    if ( data & CONTROL_BOOTLOAD )
+    {
+        rebootflag = 1;
+    }
+}
+
+
+static void write_restart( uint8_t index, uint8_t data )
+{
+    registers_set_mask( REG_START_ENABLE, START_TIMEOUT );
+}
+
+
+static void write_seconds( uint8_t index, uint8_t data )
+{
+    uint32_t s;
+
+    // The new second starts now
+    memcpy( &s, &registers[ REG_SECONDS_0 ], sizeof( s ) );
+    board_set_rtc( s );
+}
+
+
+static void write_alarm( uint8_t index, uint8_t data )
+{
+    uint32_t a;
+
+    memcpy( &a, &registers[ REG_ALARM_0 ], sizeof( a ) );
+    board_set_alarm( a );
+}
+
+
+static void write_schedule( uint8_t index, uint8_t data )
+{
+    schedule_host_write( data );
+}
+
+
+static void write_charge_current( uint8_t index, uint8_t data )
+{
+    board_set_charge_current( data );
+}
+
+
+static void write_charge_timer( uint8_t index, uint8_t data )
+{
+    board_set_charge_timer( data );
+}
+
+
+static void write_eeprom_status( uint8_t index, uint8_t data )
+{
+    registers_clear_mask( REG_EEPROM_STATUS, EEPROM_STATUS_OVERFLOW );
+}
+
+
+#define EE( p )     ( (uint8_t)(uintptr_t)( p ) )
+
+static const register_desc_type register_map[ NUM_REGISTERS ] PROGMEM =
+{
+    //                             access                        min   max   eeprom                    dflt               wide          read           write
+    [ REG_MCUSR ]              = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_OSCCAL ]             = { ACCESS_DEFER,                 0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_STATUS ]             = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_CONTROL ]            = { ACCESS_DEFER,                 0,    0,    0,                        0,                 0,            NULL,          write_control },
+    [ REG_START_ENABLE ]       = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_START_REASON ]       = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_RESTART_HOURS ]      = { 0,                            0,    0,    0,                        0,                 0,            NULL,          write_restart },
+    [ REG_RESTART_MINUTES ]    = { 0,                            0,    0,    0,                        0,                 0,            NULL,          write_restart },
+    [ REG_RESTART_SECONDS ]    = { 0,                            0,    0,    0,                        0,                 0,            NULL,          write_restart },
+    [ REG_SECONDS_0 ]          = { 0,                            0,    0,    0,                        0,                 WIDE( 0, 4 ), read_seconds,  NULL },
+    [ REG_SECONDS_1 ]          = { 0,                            0,    0,    0,                        0,                 WIDE( 1, 4 ), NULL,          NULL },
+    [ REG_SECONDS_2 ]          = { 0,                            0,    0,    0,                        0,                 WIDE( 2, 4 ), NULL,          NULL },
+    [ REG_SECONDS_3 ]          = { 0,                            0,    0,    0,                        0,                 WIDE( 3, 4 ), NULL,          write_seconds },
+    [ REG_EXTENDED ]           = { ACCESS_RO,                    0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_CAPABILITY ]         = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_BOARD_TYPE ]         = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_BOARD_REV ]          = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_BOARD_STEP ]         = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_WDT_RESET ]          = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_WDT_POWER ]          = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_WDT_STOP ]           = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_WDT_START ]          = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_I2C_ADDRESS ]        = { ACCESS_RANGE,                 0x08, 0x77, EE( EEPROM_I2C_ADDR ),    TWI_SLAVE_ADDRESS, 0,            NULL,          NULL },
+    [ REG_I2C_ICHARGE ]        = { ACCESS_CLAMP | ACCESS_DEFER,  0,    3,    EE( EEPROM_CHG_CURRENT ), 1,                 0,            NULL,          write_charge_current },
+    [ REG_I2C_TCHARGE ]        = { ACCESS_CLAMP | ACCESS_DEFER,  3,    10,   EE( EEPROM_CHG_TIMER ),   3,                 0,            NULL,          write_charge_timer },
+    [ REG_VERSION_MAJOR ]      = { ACCESS_RO,                    0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_VERSION_MINOR ]      = { ACCESS_RO,                    0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_BUILD_MONTH ]        = { ACCESS_RO,                    0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_BUILD_DAY ]          = { ACCESS_RO,                    0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_BUILD_YEAR ]         = { ACCESS_RO,                    0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_RESTART_CE_SECONDS ] = { 0,                            0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_SECONDS_FRAC ]       = { ACCESS_RO,                    0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_RTC_TRIM_0 ]         = { ACCESS_DEFER,                 0,    0,    0,                        0,                 WIDE( 0, 2 ), NULL,          NULL },
+    [ REG_RTC_TRIM_1 ]         = { ACCESS_DEFER,                 0,    0,    0,                        0,                 WIDE( 1, 2 ), NULL,          NULL },
+    [ REG_ALARM_0 ]            = { 0,                            0,    0,    0,                        0,                 WIDE( 0, 4 ), NULL,          NULL },
+    [ REG_ALARM_1 ]            = { 0,                            0,    0,    0,                        0,                 WIDE( 1, 4 ), NULL,          NULL },
+    [ REG_ALARM_2 ]            = { 0,                            0,    0,    0,                        0,                 WIDE( 2, 4 ), NULL,          NULL },
+    [ REG_ALARM_3 ]            = { 0,                            0,    0,    0,                        0,                 WIDE( 3, 4 ), NULL,          write_alarm },
+    [ REG_SCHEDULE ]           = { ACCESS_NOSTORE | ACCESS_PORT, 0,    0,    0,                        0,                 0,            read_schedule, write_schedule },
+    [ REG_EEPROM_STATUS ]      = { ACCESS_NOSTORE,               0,    0,    0,                        0,                 0,            NULL,          write_eeprom_status },
+    [ REG_SUPPLY_0 ]           = { ACCESS_RO,                    0,    0,    0,                        0,                 WIDE( 0, 2 ), NULL,          NULL },
+    [ REG_SUPPLY_1 ]           = { ACCESS_RO,                    0,    0,    0,                        0,                 WIDE( 1, 2 ), NULL,          NULL },
+    [ REG_SUPPLY_CUTOFF ]      = { 0,                            0,    0,    EE( EEPROM_VCC_CUTOFF ),  0,                 0,            NULL,          NULL },
+    [ REG_SUPPLY_RESTART ]     = { 0,                            0,    0,    EE( EEPROM_VCC_RESTART ), 0,                 0,            NULL,          NULL },
+    [ REG_SHUTDOWN_TIMEOUT ]   = { 0,                            0,    0,    EE( EEPROM_SHUTDOWN ),    30,                0,            NULL,          NULL },
+    [ REG_SHUTDOWN_STATUS ]    = { ACCESS_RO,                    0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_LATENCY_RAIL_0 ]     = { ACCESS_RO,                    0,    0,    0,                        0,                 WIDE( 0, 2 ), NULL,          NULL },
+    [ REG_LATENCY_RAIL_1 ]     = { ACCESS_RO,                    0,    0,    0,                        0,                 WIDE( 1, 2 ), NULL,          NULL },
+    [ REG_LATENCY_HOST_0 ]     = { ACCESS_RO,                    0,    0,    0,                        0,                 WIDE( 0, 2 ), NULL,          NULL },
+    [ REG_LATENCY_HOST_1 ]     = { ACCESS_RO,                    0,    0,    0,                        0,                 WIDE( 1, 2 ), NULL,          NULL },
+    [ REG_LATENCY_ATTEMPTS ]   = { ACCESS_RO,                    0,    0,    0,                        0,                 0,            NULL,          NULL },
+    [ REG_LATENCY_HISTORY ]    = { ACCESS_RO | ACCESS_PORT,      0,    0,    0,                        0,                 0,            read_latency,  NULL },
+    [ REG_EVENT_COUNT ]        = { ACCESS_RO,                    0,    0,    0,                        0,                 0,            read_count,    NULL },
+    [ REG_EVENT_FIFO ]         = { ACCESS_RO | ACCESS_PORT,      0,    0,    0,                        0,                 0,            read_events,   NULL },
+};
+
+
 // Host interface
+void registers_host_select( uint8_t index )
+{
+    latency_access();
+    read_base = 0xFF;
+    write_base = 0xFF;
+    if ( index == REG_SCHEDULE )
+    {
+        schedule_host_select();
+    }
+    else if ( index == REG_LATENCY_HISTORY )
+    {
+        latency_host_select();
+    }
+    else if ( index == REG_EVENT_FIFO )
+    {
+        events_host_select();
+    }
+}
+
+
+// Register after index in a burst.  Port registers stay put so a burst
+// streams through them.
+uint8_t registers_next( uint8_t index )
+{
+    if ( pgm_read_byte( &register_map[ index ].access ) & ACCESS_PORT )
+    {
+        return index;
+    }
+    
+    index++;
+    if ( index >= NUM_REGISTERS )
+    {
+        index = 0;
+    }
+    return index;
+}
+
+
 uint8_t registers_host_read( uint8_t index )
 {
+    register_read_hook read;
+    uint8_t wide, base;
+
     if ( activity_watchdog )
     {
         activity_watchdog = 0;
     }
+    latency_access();
     
-    switch ( index )
+    wide = pgm_read_byte( &register_map[ index ].wide );
+    if ( wide != 0 )
     {
-        case REG_STATUS:
+        base = index - WIDE_OFFSET( wide );
+        if ( ( index == base ) || ( read_base != base ) )
         {
-            // Update pgood status
-            board_pgood();
-            // Update button status
-            if ( PIND & PIN_BUTTON )
-            {
-                registers[ REG_STATUS ] &= ~STATUS_BUTTON;
-            }
-            else
-            {
-                registers[ REG_STATUS ] |= STATUS_BUTTON;
-            }
-            // Update opto status
-            if ( PINB & PIN_OPTO )
-            {
-                registers[ REG_STATUS ] &= ~STATUS_OPTO;
-            }
-            else
+            read = (register_read_hook)pgm_read_ptr( &register_map[ base ].read );
+            if ( read != NULL )
             {
-                registers[ REG_STATUS ] |= STATUS_OPTO;
+                read( base );
             }
-                
-            break;
-        }
-        case REG_SECONDS_0:
-        {
-            registers[ REG_SECONDS_0 ] = ( uint8_t )( seconds & 0xFF );
-            break;
-        }
-        case REG_SECONDS_1:
-        {
-            registers[ REG_SECONDS_1 ] = ( uint8_t )( ( seconds & 0xFF00 ) >> 8 );
-            break;
-        }
-        case REG_SECONDS_2:
-        {
-            registers[ REG_SECONDS_2 ] = ( uint8_t )( ( seconds & 0xFF0000 ) >> 16 );
-            break;
-        }
-        case REG_SECONDS_3:
-        {
-            registers[ REG_SECONDS_3 ] = ( uint8_t )( ( seconds & 0xFF000000 ) >> 24 );
-            break;
+            memcpy( read_latch, &registers[ base ], WIDE_WIDTH( wide ) );
+            read_base = base;
         }
+        return read_latch[ WIDE_OFFSET( wide ) ];
+    }
+
+    read = (register_read_hook)pgm_read_ptr( &register_map[ index ].read );
+    if ( read != NULL )
+    {
+        return read( index );
     }
-    
     return registers[ index ];
 }
 
 
 void registers_host_write( uint8_t index, uint8_t data )
 {
+    register_desc_type desc;
+    uint8_t base;
+
     if ( activity_watchdog )
     {
         activity_watchdog = 0;
     }
+    latency_access();
 
-    switch ( index )
+    memcpy_P( &desc, &register_map[ index ], sizeof( desc ) );
+    if ( desc.access & ACCESS_RO )
     {
-        case REG_OSCCAL:
+        return;
+    }
+    if ( desc.access & ACCESS_RANGE )
+    {
+        if ( ( data < desc.min ) || ( data > desc.max ) )
         {
-            OSCCAL = data;
-            break;
+            return;
         }
-        
-        case REG_CONTROL:
-        {
-            if ( data & CONTROL_CE )
-            {
-                board_ce( 1 );
-            }
-            else
-            {
-                board_ce( 0 );
-            }
-            
-            if ( data & CONTROL_LED0 )
-            {
-                board_led_on( 0 );
-            }
-            else
-            {
-                board_led_off( 0 );
-            }
+    }
+    if ( desc.access & ACCESS_CLAMP )
+    {
+        if ( data < desc.min ) data = desc.min;
+        if ( data > desc.max ) data = desc.max;
+    }
 
-            if ( data & CONTROL_LED1 )
-            {
-                board_led_on( 1 );
-            }
-            else
-            {
-                board_led_off( 1 );
-            }
-            
-            if ( data & CONTROL_BOOTLOAD )
-            {
-                rebootflag = 1;
-            }
-            
-            break;
-        }
-        
-        case REG_RESTART_HOURS:
-        case REG_RESTART_MINUTES:
-        case REG_RESTART_SECONDS:
+    if ( desc.wide != 0 )
+    {
+        base = index - WIDE_OFFSET( desc.wide );
+        if ( write_base != base )
         {
-            registers[ index ] = data;    
-            registers_set_mask( REG_START_ENABLE, START_TIMEOUT );
-            return;
+            memcpy( write_latch, &registers[ base ], WIDE_WIDTH( desc.wide ) );
+            write_base = base;
         }
-
-        case REG_SECONDS_0:
-        case REG_SECONDS_1:
-        case REG_SECONDS_2:
-        case REG_SECONDS_3:
+        write_latch[ WIDE_OFFSET( desc.wide ) ] = data;
+        if ( WIDE_OFFSET( desc.wide ) != WIDE_WIDTH( desc.wide ) - 1 )
         {
-            registers[ index ] = data;    
-            seconds = *(uint32_t*)&registers[ REG_SECONDS_0 ];
             return;
         }
-        
-        case REG_I2C_ADDRESS:
+        memcpy( &registers[ base ], write_latch, WIDE_WIDTH( desc.wide ) );
+        write_base = 0xFF;
+        read_base = 0xFF;
+    }
+    else if ( !( desc.access & ACCESS_NOSTORE ) )
+    {
+        registers[ index ] = data;
+    }
+    if ( desc.eeprom != 0 )
+    {
+        eeprom_queue_byte( (uint8_t*)(uintptr_t)desc.eeprom, data );
+    }
+    if ( desc.access & ACCESS_DEFER )
+    {
+        pending[ index >> 3 ] |= ( 1 << ( index & 7 ) );
+        pending_any = 1;
+    }
+    else if ( desc.write != NULL )
+    {
+        desc.write( index, data );
+    }
+}
+
+
+// Main loop: run the write hooks deferred by the TWI ISR, with the value
+// the register holds now
+void registers_commit( void )
+{
+    register_write_hook write;
+    uint8_t i, mask, set, data;
+
+    if ( !pending_any )
+    {
+        return;
+    }
+    pending_any = 0;
+
+    for ( i = 0; i < NUM_REGISTERS; i++ )
+    {
+        mask = 1 << ( i & 7 );
+        cli();
+        set = pending[ i >> 3 ] & mask;
+        pending[ i >> 3 ] &= ~mask;
+        data = registers[ i ];
+        sei();
+
+        if ( set )
         {
-            if ( ( data >= 0x08 ) && ( data <= 0x77 ) )
+            write = (register_write_hook)pgm_read_ptr( &register_map[ i ].write );
+            if ( write != NULL )
             {
-                eeprom_update_byte( EEPROM_I2C_ADDR, data );    // TODO: interrupt context
+                write( i, data );
             }
-            break;
         }
+    }
+}
 
-        case REG_I2C_ICHARGE:
-        {
-            if ( data > 3 ) data = 3;
-            board_set_charge_current( data );
-            eeprom_update_byte( EEPROM_CHG_CURRENT, data );    // TODO: interrupt context
-            break;
-        }
 
-        case REG_I2C_TCHARGE:
-        {
-            if ( data < 3 ) data = 3;
-            if ( data > 10 ) data = 10;
-            board_set_charge_timer( data );
-            eeprom_update_byte( EEPROM_CHG_TIMER, data );    // TODO: interrupt context
-            break;
-        }
+// Main loop: writes are waiting for registers_commit()
+uint8_t registers_pending( void )
+{
+    return pending_any;
+}
 
-        // Read-only registers
-        case REG_EXTENDED:
-        case REG_VERSION_MAJOR:
-        case REG_VERSION_MINOR:
-        case REG_BUILD_MONTH:
-        case REG_BUILD_DAY:
-        case REG_BUILD_YEAR:
-        {
-            return;
-        }
-        
-        default:
-        {
-            break;
-        }
+
+// Main loop: bring the registers that mirror inputs up to date, so the
+// TWI ISR can send them as they are
+void registers_refresh( void )
+{
+    uint8_t status = 0;
+
+    if ( board_pgood() )
+    {
+        status |= STATUS_POWER_GOOD;
     }
-    
-    registers[ index ] = data;    
+    if ( ( PIND & PIN_BUTTON ) == 0 )
+    {
+        status |= STATUS_BUTTON;
+    }
+    if ( ( PINB & PIN_OPTO ) == 0 )
+    {
+        status |= STATUS_OPTO;
+    }
+    registers[ REG_STATUS ] = ( registers[ REG_STATUS ] & ~( STATUS_POWER_GOOD | STATUS_BUTTON | STATUS_OPTO ) ) | status;
 }
 
 
 void registers_init( void )
 {
-    uint8_t t;
+    uint8_t i, t, slot;
+    int16_t trim;
     
     registers[ REG_CONTROL ]         = CONTROL_CE | CONTROL_BUTTON_PWR_PASS;
     registers[ REG_START_ENABLE ]    = START_ALL;
@@ -228,7 +511,7 @@ void registers_init( void )
     registers[ REG_RESTART_MINUTES ] = 0;
     registers[ REG_RESTART_SECONDS ] = 0;
     registers[ REG_EXTENDED ]        = 0x69;
-    registers[ REG_CAPABILITY ]      = CAPABILITY_VERSION;
+    registers[ REG_CAPABILITY ]      = CAPABILITY_EVENTS;
     registers[ REG_BOARD_TYPE ]      = eeprom_get_board_type();
     registers[ REG_BOARD_REV ]       = eeprom_get_revision_value();
     registers[ REG_BOARD_STEP ]      = eeprom_get_stepping_value();
@@ -239,25 +522,29 @@ void registers_init( void )
     registers[ REG_BUILD_DAY ]       = DAY;
     registers[ REG_BUILD_YEAR ]      = YEAR;
     
-    t = eeprom_get_i2c_address();
-    if ( t == 0xFF )
-    {
-        t = TWI_SLAVE_ADDRESS;
-    }
-    registers[ REG_I2C_ADDRESS ]     = t;
-    
-    t = eeprom_get_charge_current();
-    if ( t == 0xFF )
+    // EEPROM-backed settings
+    for ( i = 0; i < NUM_REGISTERS; i++ )
     {
-        t = 1;  // 1/3 amp default
+        slot = pgm_read_byte( &register_map[ i ].eeprom );
+        if ( slot != 0 )
+        {
+            t = eeprom_read_byte( (uint8_t*)(uintptr_t)slot );
+            if ( t == 0xFF )
+            {
+                t = pgm_read_byte( &register_map[ i ].dflt );
+            }
+            registers[ i ] = t;
+        }
     }
-    registers[ REG_I2C_ICHARGE ]     = t;
 
-    t = eeprom_get_charge_timer();
-    if ( t == 0xFF )
-    {
-        t = 3;  // 3 hours default
-    }
-    registers[ REG_I2C_TCHARGE ]      = t;
+    trim = eeprom_get_rtc_trim();
+    registers[ REG_RTC_TRIM_0 ]      = (uint16_t)trim & 0xFF;
+    registers[ REG_RTC_TRIM_1 ]      = (uint16_t)trim >> 8;
+    registers[ REG_EEPROM_STATUS ]   = 0;
+    registers[ REG_SHUTDOWN_STATUS ] = SHUTDOWN_NONE;
+    registers[ REG_LATENCY_RAIL_0 ]  = 0xFF;
+    registers[ REG_LATENCY_RAIL_1 ]  = 0xFF;
+    registers[ REG_LATENCY_HOST_0 ]  = 0xFF;
+    registers[ REG_LATENCY_HOST_1 ]  = 0xFF;
 }
 
@@ -22,7 +22,7 @@ enum registers_type {
     REG_BOARD_STEP,             // 17   Hardware stepping (if known) in ASCII (ie: '1')
     REG_WDT_RESET,              // 18   Reset watchdog countdown register (seconds, 0 to disable)
     REG_WDT_POWER,              // 19   Power-cycle watchdog countdown register (seconds, 0 to disable)
-    REG_WDT_STOP,               // 20   Power-off countdown (single-shot seconds, 0 to disable)
+    REG_WDT_STOP,               // 20   Shutdown countdown (single-shot seconds, 0 to disable)
     REG_WDT_START,              // 21   Start-up activity watchdog countdown (seconds, 0 to disable)
     REG_I2C_ADDRESS,            // 22   Slave address to use on I2C interface
     REG_I2C_ICHARGE,            // 23   Charge current (0-3)/3 amp (PowerPi only)
@@ -36,6 +36,30 @@ enum registers_type {
     
     REG_RESTART_CE_SECONDS,     // 30   Delay for CE restart after power-off
     
+    REG_SECONDS_FRAC,           // 31   Fraction of the current second in 1/256 s (latched by reading REG_SECONDS_0)
+    REG_RTC_TRIM_0,             // 32   RTC drift correction, signed 0.1 ppm units, positive speeds up (LSB)
+    REG_RTC_TRIM_1,             // 33   "                                                              (MSB)
+    REG_ALARM_0,                // 34   Wake-up alarm, RTC seconds value, 0 to disable (LSB)
+    REG_ALARM_1,                // 35   "
+    REG_ALARM_2,                // 36   "
+    REG_ALARM_3,                // 37   "   (MSB, writing it arms the alarm)
+    REG_SCHEDULE,               // 38   Wake schedule table port, see schedule.h
+    REG_EEPROM_STATUS,          // 39   Deferred EEPROM write status, writing clears OVERFLOW
+    REG_SUPPLY_0,               // 40   Measured VCC in mV (LSB)
+    REG_SUPPLY_1,               // 41   "                  (MSB)
+    REG_SUPPLY_CUTOFF,          // 42   Low supply cutoff, 20 mV units, 0 to disable
+    REG_SUPPLY_RESTART,         // 43   Supply needed to allow wakes again after a cutoff, 20 mV units
+    REG_SHUTDOWN_TIMEOUT,       // 44   Seconds the host gets to drop 3V3 after PWR_BUT, 0 cuts power at once
+    REG_SHUTDOWN_STATUS,        // 45   How the last power-down went, see SHUTDOWN_*
+    REG_LATENCY_RAIL_0,         // 46   Last power-up, wake to 3V3 up in 1/256 s (LSB)
+    REG_LATENCY_RAIL_1,         // 47   "                                        (MSB)
+    REG_LATENCY_HOST_0,         // 48   Last power-up, wake to first host access in 1/256 s (LSB)
+    REG_LATENCY_HOST_1,         // 49   "                                                   (MSB)
+    REG_LATENCY_ATTEMPTS,       // 50   Last power-up, attempts made
+    REG_LATENCY_HISTORY,        // 51   Power-up record ring port, see latency.h
+    REG_EVENT_COUNT,            // 52   Events not yet read from REG_EVENT_FIFO
+    REG_EVENT_FIFO,             // 53   Event log port, see events.h
+    
     NUM_REGISTERS
 };
 
@@ -44,6 +68,7 @@ enum registers_type {
 #define STATUS_POWER_GOOD       0x01    // PG state 
 #define STATUS_BUTTON           0x02    // Button state
 #define STATUS_OPTO             0x04    // Opto state
+#define STATUS_LOW_SUPPLY       0x08    // Supply below cutoff, wakes are ignored
 
 // CONTROL register bits
 #define CONTROL_CE              0x01
@@ -53,12 +78,24 @@ enum registers_type {
 #define CONTROL_BUTTON_PWR_PASS 0x10    // In the on state, pass button press to BB PWR_BUT
 #define CONTROL_BOOTLOAD        0x80
 
+// EEPROM_STATUS register bits
+#define EEPROM_STATUS_BUSY      0x01    // Writes queued or in progress
+#define EEPROM_STATUS_OVERFLOW  0x02    // A write was dropped because the queue was full
+
+// SHUTDOWN_STATUS values
+#define SHUTDOWN_NONE           0x00    // No power-down since reset
+#define SHUTDOWN_HOST           0x01    // Host dropped 3V3 on its own
+#define SHUTDOWN_CLEAN          0x02    // Host dropped 3V3 after PWR_BUT
+#define SHUTDOWN_TIMEOUT        0x03    // Power cut after REG_SHUTDOWN_TIMEOUT
+#define SHUTDOWN_FORCED         0x04    // Power cut without asking the host
+
 // START enable and reason register bits
 #define START_BUTTON            0x01
 #define START_EXTERNAL          0x02
 #define START_PWRGOOD           0x04
 #define START_TIMEOUT           0x08
-#define START_ALL               0x0F
+#define START_ALARM             0x10    // Wake-up alarm or schedule entry
+#define START_ALL               0x1F
 
 // CAPABILITY levels
 #define CAPABILITY_RTC          0x00    // The presence of the "extended" register alone indicates RTC
@@ -68,6 +105,16 @@ enum registers_type {
 #define CAPABILITY_STATUS       0x04    // Current button and opto state in status register
 #define CAPABILITY_VERSION      0x05    // Version and build registers are available
 #define CAPABILITY_PWRBUT       0x06    // PWRBUT pass-thru is available
+#define CAPABILITY_RTC_FRAC     0x07    // Sub-second RTC fraction, writing REG_SECONDS_3 restarts the second
+#define CAPABILITY_RTC_TRIM     0x08    // RTC drift correction
+#define CAPABILITY_ALARM        0x09    // Absolute wake-up alarm
+#define CAPABILITY_SCHEDULE     0x0A    // Wake schedule table
+#define CAPABILITY_EEPROM_QUEUE 0x0B    // EEPROM writes are deferred, see REG_EEPROM_STATUS
+#define CAPABILITY_WIDE_LATCH   0x0C    // Multi-byte registers read as a snapshot, written on the last byte
+#define CAPABILITY_SUPPLY       0x0D    // Supply measurement and low supply cutoff
+#define CAPABILITY_SHUTDOWN     0x0E    // Power-down asks the host through PWR_BUT first
+#define CAPABILITY_LATENCY      0x0F    // Power-up latency records
+#define CAPABILITY_EVENTS       0x10    // Event log
 
 // Board types
 #define BOARD_TYPE_BONE         0x00
@@ -80,8 +127,14 @@ void registers_set_mask( uint8_t index, uint8_t mask );
 void registers_clear_mask( uint8_t index, uint8_t mask );
 uint8_t registers_get( uint8_t index );
 void registers_set( uint8_t idx, uint8_t data );
+void registers_set_seconds( uint32_t value );
 uint8_t registers_host_read( uint8_t idx );
 void registers_host_write( uint8_t idx, uint8_t data );
+void registers_host_select( uint8_t idx );
+uint8_t registers_next( uint8_t idx );
+void registers_commit( void );
+uint8_t registers_pending( void );
+void registers_refresh( void );
 #endif
 
 #endif  // __REGISTERS_H__
@@ -0,0 +1,231 @@
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include "registers.h"
+#include "eeprom.h"
+#include "schedule.h"
+
+
+extern void power_event( uint8_t reason );
+extern volatile uint32_t seconds;
+
+static schedule_entry_type table[ SCHEDULE_ENTRIES ];
+static uint8_t staging[ SCHEDULE_SIZE ];
+static uint8_t saving[ SCHEDULE_SIZE ];
+static uint8_t save_position = SCHEDULE_SIZE;
+static uint8_t position;
+static volatile uint8_t staged;
+static volatile uint8_t dirty;
+static volatile uint8_t rebase;
+
+
+void schedule_init( void )
+{
+    uint8_t i;
+
+    eeprom_read_block( table, EEPROM_SCHEDULE, SCHEDULE_SIZE );
+    for ( i = 0; i < SCHEDULE_ENTRIES; i++ )
+    {
+        // Erased EEPROM
+        if ( table[ i ].start == 0xFFFFFFFF )
+        {
+            table[ i ].start = 0;
+            table[ i ].period = 0;
+        }
+    }
+}
+
+
+static uint8_t advance( schedule_entry_type *e, uint32_t now )
+{
+    if ( ( e->start == 0 ) || ( now < e->start ) )
+    {
+        return 0;
+    }
+
+    if ( e->period == 0 )
+    {
+        e->start = 0;
+    }
+    else
+    {
+        e->start += ( ( now - e->start ) / e->period + 1 ) * e->period;
+    }
+    return 1;
+}
+
+
+// Called from the timer2 ISR every tick
+void schedule_tick( uint32_t now )
+{
+    uint8_t i, fire = 0;
+
+    for ( i = 0; i < SCHEDULE_ENTRIES; i++ )
+    {
+        fire |= advance( &table[ i ], now );
+    }
+
+    if ( fire )
+    {
+        power_event( START_ALARM );
+    }
+}
+
+
+// Seconds from now to the earliest wake, 0xFFFFFFFF if none
+uint32_t schedule_next( uint32_t now )
+{
+    uint32_t next = 0xFFFFFFFF;
+    uint8_t i;
+
+    for ( i = 0; i < SCHEDULE_ENTRIES; i++ )
+    {
+        if ( table[ i ].start == 0 )
+        {
+            continue;
+        }
+        if ( table[ i ].start <= now )
+        {
+            return 0;
+        }
+        if ( table[ i ].start - now < next )
+        {
+            next = table[ i ].start - now;
+        }
+    }
+    return next;
+}
+
+
+// Skip wakes that are already past, without firing.  Used when the table
+// is loaded or the RTC is set.
+static void schedule_rebase( uint32_t now )
+{
+    uint8_t i;
+
+    for ( i = 0; i < SCHEDULE_ENTRIES; i++ )
+    {
+        advance( &table[ i ], now );
+    }
+}
+
+
+// Called from the TWI ISR when the host sets the RTC.  Entries the clock
+// jumped over are skipped by schedule_save(), not in the ISR.
+void schedule_clock_set( void )
+{
+    rebase = 1;
+}
+
+
+// Main loop: install a newly uploaded table and persist it, outside
+// interrupt context.  The table is written a byte at a time, only while
+// the EEPROM is idle and no host write is queued, as events_service()
+// does, so the loop never waits on the 64 byte write.
+void schedule_save( void )
+{
+    uint8_t i;
+
+    if ( rebase )
+    {
+        cli();
+        schedule_rebase( seconds );
+        rebase = 0;
+        sei();
+    }
+
+    if ( staged )
+    {
+        cli();
+        memcpy( table, staging, SCHEDULE_SIZE );
+        schedule_rebase( seconds );
+        for ( i = 0; i < SCHEDULE_ENTRIES; i++ )
+        {
+            if ( table[ i ].start != 0 )
+            {
+                registers_set_mask( REG_START_ENABLE, START_ALARM );
+            }
+        }
+        staged = 0;
+        dirty = 1;
+        sei();
+    }
+
+    if ( dirty )
+    {
+        // Restart with the latest table if it changed mid-write
+        cli();
+        memcpy( saving, table, SCHEDULE_SIZE );
+        dirty = 0;
+        sei();
+        save_position = 0;
+    }
+
+    if ( ( save_position < SCHEDULE_SIZE ) && !eeprom_queue_pending() )
+    {
+        eeprom_update_byte( (uint8_t*)EEPROM_SCHEDULE + save_position, saving[ save_position ] );
+        save_position++;
+    }
+}
+
+
+// Main loop: an uploaded table is waiting for schedule_save() or not yet
+// in EEPROM
+uint8_t schedule_pending( void )
+{
+    return staged || dirty || rebase || ( save_position < SCHEDULE_SIZE );
+}
+
+
+// Everything to EEPROM, before the bootloader takes over
+void schedule_flush( void )
+{
+    while ( schedule_pending() )
+    {
+        eeprom_busy_wait();
+        schedule_save();
+    }
+    eeprom_busy_wait();
+}
+
+
+// REG_SCHEDULE port, called from the TWI ISR.  Selecting the register
+// rewinds it; a write of the complete table replaces the active one once
+// the main loop picks it up, and reads return the uploaded table until
+// then.
+void schedule_host_select( void )
+{
+    position = 0;
+}
+
+
+uint8_t schedule_host_read( void )
+{
+    if ( position < SCHEDULE_SIZE )
+    {
+        return staged ? staging[ position++ ] : ( (uint8_t*)table )[ position++ ];
+    }
+    return 0xFF;
+}
+
+
+void schedule_host_write( uint8_t data )
+{
+    if ( position >= SCHEDULE_SIZE )
+    {
+        return;
+    }
+
+    // A new upload overwrites staging, so drop any table not yet taken
+    if ( position == 0 )
+    {
+        staged = 0;
+    }
+    staging[ position++ ] = data;
+    if ( position == SCHEDULE_SIZE )
+    {
+        staged = 1;
+    }
+}
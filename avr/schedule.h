@@ -0,0 +1,30 @@
+#ifndef __SCHEDULE_H__
+#define __SCHEDULE_H__
+
+// Wake schedule
+//
+// Each entry wakes the board at start, then every period seconds after
+// that (0 for a single wake).  The host uploads the whole table as one
+// burst through the REG_SCHEDULE port; the table is kept in EEPROM.
+
+#define SCHEDULE_ENTRIES    8
+#define SCHEDULE_SIZE       ( SCHEDULE_ENTRIES * sizeof( schedule_entry_type ) )
+
+typedef struct {
+    uint32_t start;         // RTC seconds of the next wake, 0 if unused
+    uint32_t period;        // Seconds between wakes, 0 for once
+} schedule_entry_type;
+
+void schedule_init( void );
+void schedule_tick( uint32_t now );
+uint32_t schedule_next( uint32_t now );
+void schedule_clock_set( void );
+void schedule_save( void );
+uint8_t schedule_pending( void );
+void schedule_flush( void );
+
+void schedule_host_select( void );
+uint8_t schedule_host_read( void );
+void schedule_host_write( uint8_t data );
+
+#endif  // __SCHEDULE_H__
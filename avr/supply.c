@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "registers.h"
+#include "board.h"
+#include "supply.h"
+#include "events.h"
+
+extern void power_event( uint8_t reason );
+
+static volatile uint8_t low;
+static volatile uint8_t held;           // START_* wakes that came in while low
+static uint8_t sampled;
+static uint32_t last_sample;
+
+
+// Main loop, every tick.  Measures when SUPPLY_INTERVAL has passed and
+// updates the low supply state, with hysteresis between the thresholds.
+void supply_check( uint32_t now )
+{
+    uint16_t mv, cutoff, restart;
+    uint8_t reasons;
+
+    if ( sampled && ( now - last_sample < SUPPLY_INTERVAL ) )
+    {
+        return;
+    }
+    sampled = 1;
+    last_sample = now;
+
+    mv = board_read_vcc();
+    cutoff = registers_get( REG_SUPPLY_CUTOFF ) * SUPPLY_UNIT;
+    restart = registers_get( REG_SUPPLY_RESTART ) * SUPPLY_UNIT;
+    if ( restart < cutoff )
+    {
+        restart = cutoff;
+    }
+
+    if ( cutoff == 0 )
+    {
+        low = 0;
+    }
+    else if ( mv < cutoff )
+    {
+        if ( !low )
+        {
+            event_log( EVENT_LOW_SUPPLY, mv / SUPPLY_UNIT );
+        }
+        low = 1;
+    }
+    else if ( mv >= restart )
+    {
+        low = 0;
+    }
+
+    cli();
+    registers_set( REG_SUPPLY_0, mv & 0xFF );
+    registers_set( REG_SUPPLY_1, mv >> 8 );
+    if ( low )
+    {
+        registers_set_mask( REG_STATUS, STATUS_LOW_SUPPLY );
+    }
+    else
+    {
+        registers_clear_mask( REG_STATUS, STATUS_LOW_SUPPLY );
+    }
+    reasons = low ? 0 : held;
+    held = 0;
+    sei();
+
+    if ( reasons )
+    {
+        power_event( reasons );
+    }
+}
+
+
+// Too low to power the host, from the last measurement
+uint8_t supply_low( void )
+{
+    return low;
+}
+
+
+// Called from power_event(), in ISRs too.  The callers have already used
+// the wake up, so it is kept here until the supply recovers.
+void supply_hold_wake( uint8_t reason )
+{
+    held |= reason;
+}
@@ -0,0 +1,18 @@
+#ifndef __SUPPLY_H__
+#define __SUPPLY_H__
+
+// Supply supervisor
+//
+// VCC is measured against the 1.1 V bandgap every SUPPLY_INTERVAL seconds.
+// Below REG_SUPPLY_CUTOFF the host is powered down and wake events are
+// held back until VCC is back at REG_SUPPLY_RESTART, then acted on.  Thresholds are in
+// SUPPLY_UNIT mV steps, a cutoff of 0 turns the supervisor off.
+
+#define SUPPLY_INTERVAL     16          // Seconds between measurements
+#define SUPPLY_UNIT         20          // mV per threshold step
+
+void supply_check( uint32_t now );
+uint8_t supply_low( void );
+void supply_hold_wake( uint8_t reason );
+
+#endif  // __SUPPLY_H__
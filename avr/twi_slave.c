@@ -25,13 +25,8 @@ ISR( TWI_vect )
         case 0xA8:  // SLA+R
         case 0xB8:  // Data sent + ACK
         {
-            TWDR = registers_host_read( reg_index++ );
-            
-            if ( reg_index >= NUM_REGISTERS )
-            {
-                reg_index = 0;
-            }
-                
+            TWDR = registers_host_read( reg_index );
+            reg_index = registers_next( reg_index );
             break;
         }
         
@@ -42,16 +37,13 @@ ISR( TWI_vect )
             
             if ( data_count == 0 )
             {
-                reg_index = data;
+                reg_index = ( data < NUM_REGISTERS ) ? data : 0;
+                registers_host_select( reg_index );
             }
             else
             {
-                registers_host_write( reg_index++, data );
-            }
-            
-            if ( reg_index >= NUM_REGISTERS )
-            {
-                reg_index = 0;
+                registers_host_write( reg_index, data );
+                reg_index = registers_next( reg_index );
             }
             
             data_count++;
@@ -0,0 +1,280 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <sys/timex.h>
+#include "powercape.h"
+
+// Clock discipline
+//
+// Keeps the system clock on the cape RTC without stepping it.  Each poll
+// averages a few RTC reads, which dithers the 1/256 s fraction, and pairs
+// the result with CLOCK_MONOTONIC_RAW.  A least-squares fit over the recent
+// polls gives the cape rate against the undisciplined oscillator; that
+// rate plus a phase term that removes the offset over CLOCK_PHASE_POLLS
+// polls is loaded into the kernel with adjtimex( ADJ_FREQUENCY ).  Only a
+// large offset at start-up is stepped.
+
+#define CLOCK_POLL          64          // Seconds between polls
+#define CLOCK_READS         8           // RTC reads averaged per poll
+#define CLOCK_READ_GAP      13000       // us, not a multiple of 1/256 s
+#define CLOCK_HISTORY       32          // Polls in the frequency fit
+#define CLOCK_MIN_FIT       4           // Polls before trusting the fit
+#define CLOCK_PHASE_POLLS   4           // Polls to slew out an offset
+#define CLOCK_MAX_PPM       500.0       // Kernel frequency limit
+#define CLOCK_STEP_NS       500000000LL // Step instead of slew at start-up
+
+static volatile sig_atomic_t clock_running = 1;
+
+
+static void clock_stop( int sig )
+{
+    clock_running = 0;
+}
+
+
+static int64_t ts_ns( const struct timespec *ts )
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+
+// Average offset of the cape RTC from the system clock, and a cape time
+// paired with the raw monotonic time it was read at.
+static int clock_measure( int capability, int64_t *offset, int64_t *raw, int64_t *cape_ns )
+{
+    struct timespec cape, sys, real_now, raw_now;
+    int64_t sum_offset = 0, sum_lead = 0, r = 0;
+    int i;
+
+    for ( i = 0; i < CLOCK_READS; i++ )
+    {
+        if ( i > 0 )
+        {
+            usleep( CLOCK_READ_GAP );
+        }
+        if ( cape_read_rtc_frac( &cape, &sys, capability ) != 0 )
+        {
+            return -1;
+        }
+        clock_gettime( CLOCK_MONOTONIC_RAW, &raw_now );
+        clock_gettime( CLOCK_REALTIME, &real_now );
+
+        // Raw time of the read
+        r = ts_ns( &raw_now ) - ( ts_ns( &real_now ) - ts_ns( &sys ) );
+        sum_offset += ts_ns( &cape ) - ts_ns( &sys );
+        sum_lead += ts_ns( &cape ) - r;
+    }
+
+    *offset = sum_offset / CLOCK_READS;
+    *raw = r;
+    *cape_ns = r + sum_lead / CLOCK_READS;
+    return 0;
+}
+
+
+// Slope of cape time against raw time, as a fractional rate error.
+static int clock_fit( const int64_t *raw, const int64_t *cape, int n, double *rate )
+{
+    double mx = 0, my = 0, sxx = 0, sxy = 0, x, y;
+    int i;
+
+    for ( i = 0; i < n; i++ )
+    {
+        mx += ( raw[ i ] - raw[ 0 ] ) / 1e9;
+        my += ( cape[ i ] - cape[ 0 ] ) / 1e9;
+    }
+    mx /= n;
+    my /= n;
+
+    for ( i = 0; i < n; i++ )
+    {
+        x = ( raw[ i ] - raw[ 0 ] ) / 1e9 - mx;
+        y = ( cape[ i ] - cape[ 0 ] ) / 1e9 - my;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    if ( sxx <= 0 )
+    {
+        return -1;
+    }
+
+    *rate = sxy / sxx - 1;
+    return 0;
+}
+
+
+static int clock_step( int64_t offset )
+{
+    struct timespec ts;
+    int64_t ns;
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+    ns = ts_ns( &ts ) + offset;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+
+    return clock_settime( CLOCK_REALTIME, &ts );
+}
+
+
+static int clock_set_ppm( double ppm )
+{
+    struct timex tx;
+
+    memset( &tx, 0, sizeof( tx ) );
+    tx.modes = ADJ_FREQUENCY;
+    tx.freq = ( long )( ppm * 65536.0 );
+    if ( adjtimex( &tx ) < 0 )
+    {
+        fprintf( stderr, "adjtimex: %s\n", strerror( errno ) );
+        return -1;
+    }
+    return 0;
+}
+
+
+// The kernel is left at the frequency it had before, however the daemon
+// stops, so the clock does not run on at a rate nobody is correcting.
+int cape_clock_daemon( void )
+{
+    int64_t raw[ CLOCK_HISTORY ], cape[ CLOCK_HISTORY ];
+    int64_t offset, now_raw, now_cape;
+    struct timex tx;
+    double rate, ppm, base_ppm;
+    int capability, n = 0, rc = 0;
+
+    // Whole-second reads are too coarse to slew from
+    capability = cape_capability();
+    if ( capability < CAPABILITY_RTC_FRAC )
+    {
+        fprintf( stderr, "Cape firmware has no sub-second RTC\n" );
+        return 1;
+    }
+
+    memset( &tx, 0, sizeof( tx ) );
+    if ( adjtimex( &tx ) < 0 )
+    {
+        fprintf( stderr, "adjtimex: %s\n", strerror( errno ) );
+        return 1;
+    }
+    base_ppm = tx.freq / 65536.0;
+
+    signal( SIGTERM, clock_stop );
+    signal( SIGINT, clock_stop );
+
+    if ( clock_measure( capability, &offset, &now_raw, &now_cape ) != 0 )
+    {
+        return 1;
+    }
+    if ( llabs( offset ) > CLOCK_STEP_NS )
+    {
+        fprintf( stderr, "Stepping system clock by %+.3fs\n", offset / 1e9 );
+        if ( clock_step( offset ) != 0 )
+        {
+            fprintf( stderr, "clock_settime: %s\n", strerror( errno ) );
+            return 1;
+        }
+        offset = 0;
+    }
+
+    while ( clock_running )
+    {
+        // Cape time as a function of raw time
+        if ( n == CLOCK_HISTORY )
+        {
+            memmove( raw, raw + 1, sizeof( raw[ 0 ] ) * ( CLOCK_HISTORY - 1 ) );
+            memmove( cape, cape + 1, sizeof( cape[ 0 ] ) * ( CLOCK_HISTORY - 1 ) );
+            n--;
+        }
+        raw[ n ] = now_raw;
+        cape[ n ] = now_cape;
+        n++;
+
+        ppm = base_ppm;
+        if ( ( n >= CLOCK_MIN_FIT ) && ( clock_fit( raw, cape, n, &rate ) == 0 ) )
+        {
+            ppm = rate * 1e6;
+        }
+        ppm += offset / 1e3 / ( CLOCK_PHASE_POLLS * CLOCK_POLL );
+        if ( ppm > CLOCK_MAX_PPM ) ppm = CLOCK_MAX_PPM;
+        if ( ppm < -CLOCK_MAX_PPM ) ppm = -CLOCK_MAX_PPM;
+
+        if ( clock_set_ppm( ppm ) != 0 )
+        {
+            rc = 1;
+            break;
+        }
+        fprintf( stderr, "offset %+.3fms frequency %+.3fppm\n", offset / 1e6, ppm );
+
+        sleep( CLOCK_POLL );
+        if ( clock_running && ( clock_measure( capability, &offset, &now_raw, &now_cape ) != 0 ) )
+        {
+            rc = 1;
+            break;
+        }
+    }
+
+    clock_set_ppm( base_ppm );
+    return rc;
+}
+
+
+// Measure the cape drift against the system clock over a period and fold
+// it into the RTC trim.  The system clock should be on NTP meanwhile.
+int cape_clock_calibrate( int duration )
+{
+    int64_t offset0, offset1, raw0, raw1, cape_ns;
+    unsigned char trim_buf[ 3 ];
+    double ppm, elapsed;
+    int capability;
+    long trim, old;
+
+    capability = cape_capability();
+    if ( capability < CAPABILITY_RTC_TRIM )
+    {
+        fprintf( stderr, "Cape firmware has no RTC trim\n" );
+        return 1;
+    }
+    // The trim is one unit in the firmware, so both bytes go in one burst
+    trim_buf[ 0 ] = REG_RTC_TRIM_0;
+    if ( i2c_write( trim_buf, 1 ) != 0 || i2c_read( &trim_buf[ 1 ], 2 ) != 0 )
+    {
+        return 1;
+    }
+    old = (int16_t)( trim_buf[ 1 ] | ( trim_buf[ 2 ] << 8 ) );
+
+    if ( clock_measure( capability, &offset0, &raw0, &cape_ns ) != 0 )
+    {
+        return 1;
+    }
+    fprintf( stderr, "Measuring drift for %ds, offset %+.3fms\n", duration, offset0 / 1e6 );
+    sleep( duration );
+    if ( clock_measure( capability, &offset1, &raw1, &cape_ns ) != 0 )
+    {
+        return 1;
+    }
+
+    // Cape gaining on the system clock needs a negative correction
+    elapsed = ( raw1 - raw0 ) / 1e9;
+    ppm = ( offset1 - offset0 ) / 1e3 / elapsed;
+    trim = old - lround( ppm * 10 );
+    if ( trim > 32767 ) trim = 32767;
+    if ( trim < -32768 ) trim = -32768;
+
+    printf( "Drift %+.2fppm over %.0fs, trim %+.1fppm -> %+.1fppm\n", ppm, elapsed, old / 10.0, trim / 10.0 );
+
+    trim_buf[ 1 ] = trim & 0xFF;
+    trim_buf[ 2 ] = ( trim >> 8 ) & 0xFF;
+    if ( i2c_write( trim_buf, 3 ) != 0 )
+    {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,291 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "powercape.h"
+
+// Cape discovery
+//
+// Every /dev/i2c-N is scanned by its own thread, since the buses are
+// independent; addresses on one bus are probed in turn.  An address bound
+// to a kernel driver is skipped, and a plain one-byte read checks for a
+// device before anything is written to it.  The EEPROM and mux ranges are
+// skipped like i2cdetect does, since a stray byte there sets a PCA954x
+// channel mask or an EEPROM address pointer.  A cape answers a combined
+// write/read of REG_EXTENDED with 0x69 followed by its capability.
+//
+// The scan only runs for -D.  Found capes are cached in CAPE_CACHE so
+// later runs only confirm the cached location with a single transaction.
+
+#define CAPE_CACHE          "/run/powercape.cache"
+#define CAPE_MAX_BUSES      16
+#define CAPE_ADDR_FIRST     0x08
+#define CAPE_ADDR_LAST      0x77
+
+typedef struct
+{
+    int bus;
+    int found;
+    cape_info_type cape[ CAPE_MAX_CAPES ];
+} bus_scan_type;
+
+
+static int xfer( int fd, int address, unsigned char reg, unsigned char *data, int len )
+{
+    struct i2c_rdwr_ioctl_data rdwr;
+    struct i2c_msg msgs[ 2 ];
+
+    msgs[ 0 ].addr = address;
+    msgs[ 0 ].flags = 0;
+    msgs[ 0 ].len = 1;
+    msgs[ 0 ].buf = &reg;
+    msgs[ 1 ].addr = address;
+    msgs[ 1 ].flags = I2C_M_RD;
+    msgs[ 1 ].len = len;
+    msgs[ 1 ].buf = data;
+    rdwr.msgs = msgs;
+    rdwr.nmsgs = 2;
+
+    return ( ioctl( fd, I2C_RDWR, &rdwr ) == 2 ) ? 0 : -1;
+}
+
+
+// EEPROMs at 0x30-0x37 and 0x50-0x5F, PCA954x muxes at 0x70-0x77
+static int address_skipped( int address )
+{
+    return ( address >= 0x30 && address <= 0x37 ) ||
+           ( address >= 0x50 && address <= 0x5F ) ||
+           ( address >= 0x70 && address <= 0x77 );
+}
+
+
+static int probe( int fd, int bus, int address, cape_info_type *info )
+{
+    unsigned char id[ 2 ], version[ 2 ], byte;
+
+    // I2C_SLAVE fails with EBUSY when a driver owns the address; I2C_RDWR
+    // alone would not check
+    if ( ioctl( fd, I2C_SLAVE, address ) < 0 || read( fd, &byte, 1 ) != 1 )
+    {
+        return -1;
+    }
+    if ( xfer( fd, address, REG_EXTENDED, id, 2 ) != 0 || id[ 0 ] != 0x69 )
+    {
+        return -1;
+    }
+
+    info->bus = bus;
+    info->address = address;
+    info->capability = id[ 1 ];
+    info->major = info->minor = -1;
+    if ( id[ 1 ] >= CAPABILITY_VERSION && xfer( fd, address, REG_VERSION_MAJOR, version, 2 ) == 0 )
+    {
+        info->major = version[ 0 ];
+        info->minor = version[ 1 ];
+    }
+    return 0;
+}
+
+
+static int open_bus( int bus )
+{
+    char name[ 20 ];
+
+    snprintf( name, sizeof( name ), "/dev/i2c-%d", bus );
+    return open( name, O_RDWR );
+}
+
+
+static void *scan_bus( void *arg )
+{
+    bus_scan_type *scan = arg;
+    int fd, address;
+
+    fd = open_bus( scan->bus );
+    if ( fd < 0 )
+    {
+        return NULL;
+    }
+
+    for ( address = CAPE_ADDR_FIRST; address <= CAPE_ADDR_LAST && scan->found < CAPE_MAX_CAPES; address++ )
+    {
+        if ( address != BOOTLOADER_ADDRESS && !address_skipped( address ) &&
+             probe( fd, scan->bus, address, &scan->cape[ scan->found ] ) == 0 )
+        {
+            scan->found++;
+        }
+    }
+
+    close( fd );
+    return NULL;
+}
+
+
+static int compare_bus( const void *a, const void *b )
+{
+    return ( (const bus_scan_type*)a )->bus - ( (const bus_scan_type*)b )->bus;
+}
+
+
+static void cache_write( const cape_info_type *list, int count )
+{
+    FILE *f = fopen( CAPE_CACHE, "w" );
+    int i;
+
+    if ( f == NULL )
+    {
+        return;
+    }
+    for ( i = 0; i < count; i++ )
+    {
+        fprintf( f, "%d 0x%02x %d %d.%d\n", list[ i ].bus, list[ i ].address,
+                 list[ i ].capability, list[ i ].major, list[ i ].minor );
+    }
+    fclose( f );
+}
+
+
+static int cache_read( cape_info_type *list, int max )
+{
+    FILE *f = fopen( CAPE_CACHE, "r" );
+    int count = 0;
+
+    if ( f == NULL )
+    {
+        return 0;
+    }
+    while ( count < max && fscanf( f, "%d %i %d %d.%d", &list[ count ].bus, &list[ count ].address,
+                                   &list[ count ].capability, &list[ count ].major, &list[ count ].minor ) == 5 )
+    {
+        count++;
+    }
+    fclose( f );
+    return count;
+}
+
+
+// Scan every bus in parallel.  Returns the number of capes, ordered by bus
+// and address.
+int cape_discover( cape_info_type *list, int max )
+{
+    bus_scan_type scan[ CAPE_MAX_BUSES ];
+    pthread_t thread[ CAPE_MAX_BUSES ];
+    int started[ CAPE_MAX_BUSES ];
+    struct dirent *d;
+    DIR *dir;
+    int buses = 0, count = 0, i, j;
+
+    dir = opendir( "/dev" );
+    if ( dir == NULL )
+    {
+        return 0;
+    }
+    while ( buses < CAPE_MAX_BUSES && ( d = readdir( dir ) ) != NULL )
+    {
+        if ( strncmp( d->d_name, "i2c-", 4 ) == 0 )
+        {
+            memset( &scan[ buses ], 0, sizeof( scan[ 0 ] ) );
+            scan[ buses ].bus = atoi( d->d_name + 4 );
+            buses++;
+        }
+    }
+    closedir( dir );
+
+    for ( i = 0; i < buses; i++ )
+    {
+        started[ i ] = ( pthread_create( &thread[ i ], NULL, scan_bus, &scan[ i ] ) == 0 );
+        if ( !started[ i ] )
+        {
+            scan_bus( &scan[ i ] );
+        }
+    }
+    for ( i = 0; i < buses; i++ )
+    {
+        if ( started[ i ] )
+        {
+            pthread_join( thread[ i ], NULL );
+        }
+    }
+
+    qsort( scan, buses, sizeof( scan[ 0 ] ), compare_bus );
+    for ( i = 0; i < buses; i++ )
+    {
+        for ( j = 0; j < scan[ i ].found && count < max; j++ )
+        {
+            list[ count++ ] = scan[ i ].cape[ j ];
+        }
+    }
+
+    cache_write( list, count );
+    return count;
+}
+
+
+int cape_discover_print( void )
+{
+    cape_info_type list[ CAPE_MAX_CAPES ];
+    int count, i;
+
+    count = cape_discover( list, CAPE_MAX_CAPES );
+    for ( i = 0; i < count; i++ )
+    {
+        printf( "Bus %d address 0x%02x capability %d", list[ i ].bus, list[ i ].address, list[ i ].capability );
+        if ( list[ i ].major >= 0 )
+        {
+            printf( " version %d.%d", list[ i ].major, list[ i ].minor );
+        }
+        printf( "\n" );
+    }
+    if ( count == 0 )
+    {
+        fprintf( stderr, "No capes found\n" );
+        return 1;
+    }
+    return 0;
+}
+
+
+static int confirm( int bus, int address )
+{
+    cape_info_type info;
+    int fd, rc;
+
+    fd = open_bus( bus );
+    if ( fd < 0 )
+    {
+        return -1;
+    }
+    rc = probe( fd, bus, address, &info );
+    close( fd );
+    return rc;
+}
+
+
+// Pick the cape to talk to when neither bus nor address was given: the
+// cached one, then the default location.  Leaves the defaults in place if
+// nothing answers; scanning is left to -D.
+int cape_locate( void )
+{
+    cape_info_type list[ CAPE_MAX_CAPES ];
+    int count, i;
+
+    count = cache_read( list, CAPE_MAX_CAPES );
+    for ( i = 0; i < count; i++ )
+    {
+        if ( confirm( list[ i ].bus, list[ i ].address ) == 0 )
+        {
+            i2c_bus = list[ i ].bus;
+            avr_address = list[ i ].address;
+            return 0;
+        }
+    }
+
+    return confirm( i2c_bus, avr_address );
+}
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "powercape.h"
+
+// Event log drain
+//
+// Unread events come out of the REG_EVENT_FIFO port oldest first, eight
+// bytes each, and are gone once read:
+//
+//   0-3    RTC seconds
+//   4      Type
+//   5      Data
+//   6-7    Sequence number
+//
+// After an AVR reset the firmware offers its newest saved events again,
+// so the sequence number shows repeats as well as events lost to overrun.
+
+#define EVENT_RECORD        8
+#define EVENT_MAX           16
+
+static const char *event_names[] = { "?", "reset", "wake", "power-down", "power-fail",
+                                     "watchdog", "pgood-trip", "low-supply", "bootloader" };
+static const char *start_names[] = { "button", "external", "pwrgood", "timeout", "alarm", NULL };
+static const char *shutdown_names[] = { "none", "host", "clean", "timeout", "forced" };
+
+
+static uint32_t get32( const unsigned char *p )
+{
+    return p[ 0 ] | ( p[ 1 ] << 8 ) | ( p[ 2 ] << 16 ) | ( (uint32_t)p[ 3 ] << 24 );
+}
+
+
+static void print_data( int type, int data )
+{
+    int i;
+
+    switch ( type )
+    {
+        case 1:
+            printf( "mcusr=0x%02X%s%s%s%s", data,
+                    ( data & 0x01 ) ? " power-on" : "", ( data & 0x02 ) ? " external" : "",
+                    ( data & 0x04 ) ? " brown-out" : "", ( data & 0x08 ) ? " watchdog" : "" );
+            break;
+
+        case 2:
+            for ( i = 0; start_names[ i ] != NULL && !( data & ( 1 << i ) ); i++ );
+            printf( "%s", start_names[ i ] != NULL ? start_names[ i ] : "watchdog" );
+            break;
+
+        case 3:
+            printf( "%s", data <= SHUTDOWN_FORCED ? shutdown_names[ data ] : "?" );
+            break;
+
+        case 4:
+            printf( "%d attempts", data );
+            break;
+
+        case 5:
+            printf( "%s", data == REG_WDT_RESET ? "reset" : data == REG_WDT_POWER ? "power" :
+                          data == REG_WDT_STOP ? "stop" : data == REG_WDT_START ? "start" : "?" );
+            break;
+
+        case 7:
+            printf( "%d mV", data * 20 );
+            break;
+    }
+}
+
+
+int cape_events_show( void )
+{
+    unsigned char reg = REG_EVENT_FIFO, count, log[ EVENT_MAX * EVENT_RECORD ], *e;
+    time_t t;
+    int i;
+
+    if ( cape_capability() < CAPABILITY_EVENTS )
+    {
+        fprintf( stderr, "Cape firmware has no event log\n" );
+        return 1;
+    }
+
+    if ( register_read( REG_EVENT_COUNT, &count ) != 0 )
+    {
+        return 1;
+    }
+    if ( count > EVENT_MAX )
+    {
+        count = EVENT_MAX;
+    }
+    if ( count == 0 )
+    {
+        return 0;
+    }
+    if ( i2c_write( &reg, 1 ) != 0 || i2c_read( log, count * EVENT_RECORD ) != 0 )
+    {
+        return 1;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        e = &log[ i * EVENT_RECORD ];
+        if ( e[ 4 ] == 0xFF )
+        {
+            break;
+        }
+        t = get32( e );
+        printf( "%5d %.24s %-11s ", e[ 6 ] | ( e[ 7 ] << 8 ), ctime( &t ),
+                e[ 4 ] < sizeof( event_names ) / sizeof( event_names[ 0 ] ) ? event_names[ e[ 4 ] ] : "?" );
+        print_data( e[ 4 ], e[ 5 ] );
+        printf( "\n" );
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "powercape.h"
+
+// Power-up latency history
+//
+// The firmware keeps a record of each recent power-up, read newest first
+// through the REG_LATENCY_HISTORY port:
+//
+//   0-3    RTC seconds of the wake event, 0 for an unused record
+//   4      Fraction of that second, 1/256 s
+//   5      START_* reason, 0 for a watchdog power cycle
+//   6      Power-up attempts
+//   7      Reserved
+//   8-9    Wake to 3V3 up, 1/256 s
+//   10-11  Wake to first host access, 1/256 s
+//
+// Durations of 0xFFFF mean the stage was not reached, 0xFFFE that it took
+// longer than can be shown.
+
+#define LATENCY_HISTORY     8
+#define LATENCY_RECORD      12
+#define LATENCY_NONE        0xFFFF
+
+static const char *reason_names[] = { "button", "external", "pwrgood", "timeout", "alarm", NULL };
+
+
+static uint32_t get32( const unsigned char *p )
+{
+    return p[ 0 ] | ( p[ 1 ] << 8 ) | ( p[ 2 ] << 16 ) | ( (uint32_t)p[ 3 ] << 24 );
+}
+
+
+static void print_duration( unsigned int value )
+{
+    if ( value == LATENCY_NONE )
+    {
+        printf( "%9s", "-" );
+    }
+    else if ( value == LATENCY_NONE - 1 )
+    {
+        printf( "%9s", ">255s" );
+    }
+    else
+    {
+        printf( "%8.3fs", value / 256.0 );
+    }
+}
+
+
+int cape_latency_show( void )
+{
+    unsigned char reg = REG_LATENCY_HISTORY, ring[ LATENCY_HISTORY * LATENCY_RECORD ], *r;
+    const char *reason;
+    time_t wake;
+    int i, bit;
+
+    if ( cape_capability() < CAPABILITY_LATENCY )
+    {
+        fprintf( stderr, "Cape firmware has no power-up latency records\n" );
+        return 1;
+    }
+
+    if ( i2c_write( &reg, 1 ) != 0 || i2c_read( ring, sizeof( ring ) ) != 0 )
+    {
+        return 1;
+    }
+
+    printf( "%-24s %-9s %8s %9s %9s\n", "Wake", "Reason", "Attempts", "3V3", "Host" );
+    for ( i = 0; i < LATENCY_HISTORY; i++ )
+    {
+        r = &ring[ i * LATENCY_RECORD ];
+        wake = get32( r );
+        if ( wake == 0 )
+        {
+            continue;
+        }
+
+        reason = "watchdog";
+        for ( bit = 0; reason_names[ bit ] != NULL; bit++ )
+        {
+            if ( r[ 5 ] & ( 1 << bit ) )
+            {
+                reason = reason_names[ bit ];
+                break;
+            }
+        }
+
+        printf( "%.19s.%03d %-9s %8d ", ctime( &wake ), r[ 4 ] * 1000 / 256, reason, r[ 6 ] );
+        print_duration( r[ 8 ] | ( r[ 9 ] << 8 ) );
+        printf( " " );
+        print_duration( r[ 10 ] | ( r[ 11 ] << 8 ) );
+        printf( "\n" );
+    }
+    return 0;
+}
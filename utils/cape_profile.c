@@ -0,0 +1,490 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include "powercape.h"
+
+// Configuration profiles
+//
+// A profile lists the settings a cape should have, one "key = value" per
+// line with '#' comments:
+//
+//   start_enable = button,external,pwrgood,timeout,alarm   (or a number)
+//   control = ce,led0,led1,no_ce_start,button_pass         (or a number)
+//   restart = H:M:S                    Power-off restart countdown
+//   restart_ce = <seconds>             CE restart delay after power-off
+//   wdt_reset, wdt_power, wdt_stop, wdt_start = <seconds>
+//   i2c_address = <addr>
+//   charge_current = <mA>              0, 333, 667 or 1000
+//   charge_timer = <hours>             3 to 10
+//   rtc_trim = <ppm>
+//   supply_cutoff = <mV>               Power down and ignore wakes below, 0 off
+//   supply_restart = <mV>              Allow wakes again from this supply
+//   shutdown_timeout = <seconds>       Wait for the OS after PWR_BUT, 0 cuts at once
+//
+// The register file is read in two bursts, one either side of the
+// schedule port.  Only the registers that differ are written, as a few
+// contiguous bursts, then read back once.
+
+#define PROFILE_MERGE_GAP   2           // Rewrite up to this many unchanged bytes to join bursts
+#define PROFILE_SAVE_MS     500         // Wait for deferred EEPROM writes
+
+typedef enum
+{
+    FIELD_NUMBER,
+    FIELD_START,
+    FIELD_CONTROL,
+    FIELD_RESTART,
+    FIELD_CURRENT,
+    FIELD_TRIM,
+    FIELD_SUPPLY
+} field_type;
+
+typedef struct
+{
+    const char *name;
+    unsigned char reg;
+    field_type type;
+    int min;
+    int max;
+    int capability;
+} profile_field;
+
+static const profile_field fields[] =
+{
+    { "start_enable",   REG_START_ENABLE,       FIELD_START,    0, 0xFF, CAPABILITY_RTC },
+    { "control",        REG_CONTROL,            FIELD_CONTROL,  0, 0x7F, CAPABILITY_RTC },
+    { "restart",        REG_RESTART_HOURS,      FIELD_RESTART,  0, 0xFF, CAPABILITY_RTC },
+    { "restart_ce",     REG_RESTART_CE_SECONDS, FIELD_NUMBER,   0, 0xFF, CAPABILITY_VERSION },
+    { "wdt_reset",      REG_WDT_RESET,          FIELD_NUMBER,   0, 0xFF, CAPABILITY_WDT },
+    { "wdt_power",      REG_WDT_POWER,          FIELD_NUMBER,   0, 0xFF, CAPABILITY_WDT },
+    { "wdt_stop",       REG_WDT_STOP,           FIELD_NUMBER,   0, 0xFF, CAPABILITY_WDT },
+    { "wdt_start",      REG_WDT_START,          FIELD_NUMBER,   0, 0xFF, CAPABILITY_WDT },
+    { "i2c_address",    REG_I2C_ADDRESS,        FIELD_NUMBER,   0x08, 0x77, CAPABILITY_ADDR },
+    { "charge_current", REG_I2C_ICHARGE,        FIELD_CURRENT,  0, 1000, CAPABILITY_CHARGE },
+    { "charge_timer",   REG_I2C_TCHARGE,        FIELD_NUMBER,   3, 10, CAPABILITY_CHARGE },
+    { "rtc_trim",       REG_RTC_TRIM_0,         FIELD_TRIM,     0, 0, CAPABILITY_RTC_TRIM },
+    { "supply_cutoff",  REG_SUPPLY_CUTOFF,      FIELD_SUPPLY,   0, 5100, CAPABILITY_SUPPLY },
+    { "supply_restart", REG_SUPPLY_RESTART,     FIELD_SUPPLY,   0, 5100, CAPABILITY_SUPPLY },
+    { "shutdown_timeout", REG_SHUTDOWN_TIMEOUT, FIELD_NUMBER,   0, 0xFF, CAPABILITY_SHUTDOWN },
+    { NULL }
+};
+
+static const char *start_flags[] = { "button", "external", "pwrgood", "timeout", "alarm", NULL };
+static const char *control_flags[] = { "ce", "led0", "led1", "no_ce_start", "button_pass", NULL };
+
+typedef struct
+{
+    unsigned char value[ NUM_REGISTERS ];
+    unsigned char want[ NUM_REGISTERS ];
+    int top;                            // Highest register in the profile
+} profile_type;
+
+
+// Rewriting these with the value just read has no side effects
+static int reg_rewritable( int reg )
+{
+    switch ( reg )
+    {
+        case REG_START_ENABLE:
+        case REG_EXTENDED:
+        case REG_CAPABILITY:
+        case REG_BOARD_TYPE:
+        case REG_BOARD_REV:
+        case REG_BOARD_STEP:
+        case REG_I2C_ADDRESS:
+        case REG_I2C_ICHARGE:
+        case REG_I2C_TCHARGE:
+        case REG_VERSION_MAJOR:
+        case REG_VERSION_MINOR:
+        case REG_BUILD_MONTH:
+        case REG_BUILD_DAY:
+        case REG_BUILD_YEAR:
+        case REG_RESTART_CE_SECONDS:
+        case REG_SUPPLY_CUTOFF:
+        case REG_SUPPLY_RESTART:
+        case REG_SHUTDOWN_TIMEOUT:
+            return 1;
+    }
+    return 0;
+}
+
+
+// Countdown registers may tick between write and read-back
+static int reg_countdown( int reg )
+{
+    return ( reg == REG_WDT_RESET ) || ( reg == REG_WDT_POWER ) || ( reg == REG_WDT_STOP );
+}
+
+
+static int parse_flags( char *value, const char **names, int *out )
+{
+    char *tok, *end;
+    int i;
+
+    *out = strtol( value, &end, 0 );
+    if ( ( end != value ) && ( *end == 0 ) )
+    {
+        return 0;
+    }
+
+    *out = 0;
+    for ( tok = strtok( value, ", \t" ); tok != NULL; tok = strtok( NULL, ", \t" ) )
+    {
+        for ( i = 0; names[ i ] != NULL && strcmp( names[ i ], tok ) != 0; i++ );
+        if ( names[ i ] == NULL )
+        {
+            return -1;
+        }
+        *out |= 1 << i;
+    }
+    return 0;
+}
+
+
+static void set_reg( profile_type *p, int reg, int value )
+{
+    p->value[ reg ] = value;
+    p->want[ reg ] = 1;
+    if ( reg > p->top )
+    {
+        p->top = reg;
+    }
+}
+
+
+static int parse_field( profile_type *p, const profile_field *f, char *value )
+{
+    int v, h, m, s;
+    char *end;
+    double ppm;
+
+    switch ( f->type )
+    {
+        case FIELD_START:
+        case FIELD_CONTROL:
+            if ( parse_flags( value, f->type == FIELD_START ? start_flags : control_flags, &v ) != 0 ||
+                 v < f->min || v > f->max )
+            {
+                return -1;
+            }
+            set_reg( p, f->reg, v );
+            break;
+
+        case FIELD_RESTART:
+            if ( sscanf( value, "%d:%d:%d", &h, &m, &s ) != 3 ||
+                 h < 0 || h > 255 || m < 0 || m > 255 || s < 0 || s > 255 )
+            {
+                return -1;
+            }
+            set_reg( p, REG_RESTART_HOURS, h );
+            set_reg( p, REG_RESTART_MINUTES, m );
+            set_reg( p, REG_RESTART_SECONDS, s );
+            break;
+
+        case FIELD_CURRENT:
+            v = strtol( value, &end, 0 );
+            if ( *end != 0 || v < f->min || v > f->max )
+            {
+                return -1;
+            }
+            set_reg( p, f->reg, ( v * 3 + 500 ) / 1000 );
+            break;
+
+        case FIELD_SUPPLY:
+            v = strtol( value, &end, 0 );
+            if ( *end != 0 || v < f->min || v > f->max )
+            {
+                return -1;
+            }
+            set_reg( p, f->reg, ( v + 10 ) / 20 );
+            break;
+
+        case FIELD_TRIM:
+            ppm = strtod( value, &end );
+            if ( *end != 0 || fabs( ppm ) > 3276.7 )
+            {
+                return -1;
+            }
+            v = lround( ppm * 10 );
+            set_reg( p, REG_RTC_TRIM_0, v & 0xFF );
+            set_reg( p, REG_RTC_TRIM_1, ( v >> 8 ) & 0xFF );
+            break;
+
+        case FIELD_NUMBER:
+            v = strtol( value, &end, 0 );
+            if ( end == value || *end != 0 || v < f->min || v > f->max )
+            {
+                return -1;
+            }
+            set_reg( p, f->reg, v );
+            break;
+    }
+
+    return 0;
+}
+
+
+static int profile_load( const char *name, profile_type *p, int capability )
+{
+    char line[ 256 ], *key, *value, *eq, *end;
+    const profile_field *f;
+    int n = 0, rc = 0;
+    FILE *file;
+
+    memset( p, 0, sizeof( *p ) );
+    p->top = -1;
+
+    file = fopen( name, "r" );
+    if ( file == NULL )
+    {
+        fprintf( stderr, "Error opening %s: %s\n", name, strerror( errno ) );
+        return -1;
+    }
+
+    while ( fgets( line, sizeof( line ), file ) != NULL )
+    {
+        n++;
+        if ( ( end = strchr( line, '#' ) ) != NULL ) *end = 0;
+        for ( end = line + strlen( line ); ( end > line ) && ( end[ -1 ] <= ' ' ); ) *--end = 0;
+        for ( key = line; ( *key == ' ' ) || ( *key == '\t' ); key++ );
+        if ( *key == 0 )
+        {
+            continue;
+        }
+
+        eq = strchr( key, '=' );
+        if ( eq == NULL )
+        {
+            fprintf( stderr, "%s:%d: expected key = value\n", name, n );
+            rc = -1;
+            continue;
+        }
+        for ( end = eq; ( end > key ) && ( end[ -1 ] <= ' ' ); ) end--;
+        *end = 0;
+        for ( value = eq + 1; ( *value == ' ' ) || ( *value == '\t' ); value++ );
+
+        for ( f = fields; f->name != NULL && strcmp( f->name, key ) != 0; f++ );
+        if ( f->name == NULL )
+        {
+            fprintf( stderr, "%s:%d: unknown setting '%s'\n", name, n, key );
+            rc = -1;
+        }
+        else if ( capability < f->capability )
+        {
+            fprintf( stderr, "%s:%d: '%s' is not supported by this cape firmware\n", name, n, key );
+            rc = -1;
+        }
+        else if ( parse_field( p, f, value ) != 0 )
+        {
+            fprintf( stderr, "%s:%d: invalid value for '%s'\n", name, n, key );
+            rc = -1;
+        }
+    }
+
+    fclose( file );
+    return rc;
+}
+
+
+// A burst stops advancing at the schedule port, so the registers after it
+// are read separately
+static int read_file( unsigned char *regs, int count )
+{
+    unsigned char reg = 0;
+
+    if ( i2c_write( &reg, 1 ) != 0 || i2c_read( regs, count > REG_SCHEDULE ? REG_SCHEDULE : count ) != 0 )
+    {
+        return -1;
+    }
+    if ( count > REG_SCHEDULE + 1 )
+    {
+        reg = REG_SCHEDULE + 1;
+        regs[ REG_SCHEDULE ] = 0;
+        if ( i2c_write( &reg, 1 ) != 0 || i2c_read( &regs[ reg ], count - reg ) != 0 )
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int write_run( const unsigned char *values, int first, int last )
+{
+    unsigned char buf[ 1 + NUM_REGISTERS ];
+
+    buf[ 0 ] = first;
+    memcpy( buf + 1, values + first, last - first + 1 );
+    printf( "Writing registers %d-%d\n", first, last );
+
+    return i2c_write( buf, last - first + 2 );
+}
+
+
+// Firmware that queues EEPROM writes reports when they are done
+static int wait_saved( void )
+{
+    unsigned char status;
+    int ms;
+
+    for ( ms = 0; ms < PROFILE_SAVE_MS; ms += 10 )
+    {
+        if ( register_read( REG_EEPROM_STATUS, &status ) != 0 )
+        {
+            return -1;
+        }
+        if ( status & EEPROM_STATUS_OVERFLOW )
+        {
+            fprintf( stderr, "EEPROM write queue overflowed, settings were not all saved\n" );
+            register_write( REG_EEPROM_STATUS, 0 );
+            return -1;
+        }
+        if ( !( status & EEPROM_STATUS_BUSY ) )
+        {
+            return 0;
+        }
+        msleep( 10 );
+    }
+
+    fprintf( stderr, "EEPROM writes still pending after %dms\n", PROFILE_SAVE_MS );
+    return -1;
+}
+
+
+int cape_profile_apply( const char *name )
+{
+    unsigned char current[ NUM_REGISTERS ], values[ NUM_REGISTERS ], dirty[ NUM_REGISTERS ];
+    int capability, count, reg, first, last, gap, late, writes = 0, changed = 0, rc = 0;
+    profile_type p;
+
+    capability = cape_capability();
+    if ( capability < 0 )
+    {
+        fprintf( stderr, "No extended cape registers found\n" );
+        return 1;
+    }
+    if ( profile_load( name, &p, capability ) != 0 )
+    {
+        return 1;
+    }
+    if ( p.top < 0 )
+    {
+        return 0;
+    }
+
+    count = p.top + 1;
+    if ( read_file( current, count ) != 0 )
+    {
+        return 1;
+    }
+
+    // Runs of changed registers, joined across short gaps that can safely
+    // be rewritten with what was just read
+    memcpy( values, current, count );
+    for ( reg = 0; reg < count; reg++ )
+    {
+        if ( p.want[ reg ] && p.value[ reg ] != current[ reg ] )
+        {
+            values[ reg ] = p.value[ reg ];
+            changed++;
+        }
+    }
+
+    // Writing the restart countdown turns on the timeout start, so a start
+    // mask without it has to go last
+    late = p.want[ REG_START_ENABLE ] && !( p.value[ REG_START_ENABLE ] & START_TIMEOUT ) &&
+           ( values[ REG_RESTART_HOURS ] != current[ REG_RESTART_HOURS ] ||
+             values[ REG_RESTART_MINUTES ] != current[ REG_RESTART_MINUTES ] ||
+             values[ REG_RESTART_SECONDS ] != current[ REG_RESTART_SECONDS ] );
+    if ( late )
+    {
+        values[ REG_START_ENABLE ] = current[ REG_START_ENABLE ];
+    }
+
+    // The firmware takes a multi-byte register when its last byte is
+    // written, so a changed trim LSB has to carry the MSB with it
+    for ( reg = 0; reg < count; reg++ )
+    {
+        dirty[ reg ] = ( values[ reg ] != current[ reg ] );
+    }
+    if ( count > REG_RTC_TRIM_1 && dirty[ REG_RTC_TRIM_0 ] )
+    {
+        dirty[ REG_RTC_TRIM_1 ] = 1;
+    }
+
+    for ( reg = 0, first = -1, last = -1; reg <= count; reg++ )
+    {
+        if ( reg < count && dirty[ reg ] )
+        {
+            if ( first < 0 )
+            {
+                first = reg;
+            }
+            last = reg;
+            continue;
+        }
+        if ( first < 0 )
+        {
+            continue;
+        }
+
+        // Look ahead for another change reachable through rewritable bytes
+        for ( gap = reg; gap < count && gap - last <= PROFILE_MERGE_GAP &&
+                         !dirty[ gap ] && reg_rewritable( gap ); gap++ );
+        if ( gap < count && gap - last <= PROFILE_MERGE_GAP + 1 && dirty[ gap ] )
+        {
+            reg = gap - 1;
+            continue;
+        }
+
+        if ( write_run( values, first, last ) != 0 )
+        {
+            return 1;
+        }
+        writes++;
+        first = -1;
+    }
+
+    if ( late )
+    {
+        values[ REG_START_ENABLE ] = p.value[ REG_START_ENABLE ];
+        if ( write_run( values, REG_START_ENABLE, REG_START_ENABLE ) != 0 )
+        {
+            return 1;
+        }
+        writes++;
+    }
+
+    if ( writes == 0 )
+    {
+        printf( "Cape already matches %s\n", name );
+        return 0;
+    }
+
+    if ( read_file( current, count ) != 0 )
+    {
+        return 1;
+    }
+    for ( reg = 0; reg < count; reg++ )
+    {
+        if ( p.want[ reg ] && current[ reg ] != p.value[ reg ] &&
+             !( reg_countdown( reg ) && p.value[ reg ] != 0 && current[ reg ] == p.value[ reg ] - 1 ) )
+        {
+            fprintf( stderr, "Register %d reads back 0x%02X, expected 0x%02X\n", reg, current[ reg ], p.value[ reg ] );
+            rc = 1;
+        }
+    }
+
+    if ( capability >= CAPABILITY_EEPROM_QUEUE && wait_saved() != 0 )
+    {
+        rc = 1;
+    }
+
+    if ( rc == 0 )
+    {
+        printf( "Applied %s: %d registers in %d writes\n", name, changed, writes );
+    }
+    return rc;
+}
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <endian.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "powercape.h"
+
+// Wake schedule upload
+//
+// Schedule file, one wake per line, '#' starts a comment:
+//
+//   at <YYYY-MM-DD HH:MM[:SS]>             Once, local time
+//   every <seconds> [from <YYYY-MM-DD HH:MM[:SS]>]
+//                                          Repeating, first wake one period
+//                                          from now unless given
+//   daily <HH:MM[:SS]>                     Each day at local time
+//
+// Entries are { start, period } pairs in cape RTC seconds; daily is a
+// 86400 s period, so it follows the UTC offset in effect when uploaded.
+// The whole table goes to REG_SCHEDULE in one write.
+
+#define SCHEDULE_ENTRIES    8
+#define SCHEDULE_SIZE       ( SCHEDULE_ENTRIES * 8 )
+
+
+static int parse_when( const char *text, time_t *t )
+{
+    struct tm tm;
+    char *end;
+
+    memset( &tm, 0, sizeof( tm ) );
+    if ( ( ( end = strptime( text, "%Y-%m-%d %H:%M:%S", &tm ) ) == NULL || *end != 0 ) &&
+         ( ( end = strptime( text, "%Y-%m-%d %H:%M", &tm ) ) == NULL || *end != 0 ) )
+    {
+        return -1;
+    }
+    tm.tm_isdst = -1;
+    *t = mktime( &tm );
+    return 0;
+}
+
+
+static int parse_daily( const char *text, time_t *t )
+{
+    struct tm tm, when;
+    time_t now = time( NULL );
+    char *end;
+
+    memset( &when, 0, sizeof( when ) );
+    if ( ( ( end = strptime( text, "%H:%M:%S", &when ) ) == NULL || *end != 0 ) &&
+         ( ( end = strptime( text, "%H:%M", &when ) ) == NULL || *end != 0 ) )
+    {
+        return -1;
+    }
+
+    localtime_r( &now, &tm );
+    tm.tm_hour = when.tm_hour;
+    tm.tm_min = when.tm_min;
+    tm.tm_sec = when.tm_sec;
+    tm.tm_isdst = -1;
+    *t = mktime( &tm );
+    if ( *t <= now )
+    {
+        tm.tm_mday++;
+        tm.tm_isdst = -1;
+        *t = mktime( &tm );
+    }
+    return 0;
+}
+
+
+static void put32( unsigned char *p, uint32_t v )
+{
+    p[ 0 ] = v & 0xFF;
+    p[ 1 ] = ( v >> 8 ) & 0xFF;
+    p[ 2 ] = ( v >> 16 ) & 0xFF;
+    p[ 3 ] = ( v >> 24 ) & 0xFF;
+}
+
+
+static uint32_t get32( const unsigned char *p )
+{
+    return p[ 0 ] | ( p[ 1 ] << 8 ) | ( p[ 2 ] << 16 ) | ( (uint32_t)p[ 3 ] << 24 );
+}
+
+
+static int schedule_load( const char *name, unsigned char *table )
+{
+    char line[ 256 ], *p, *arg, *from;
+    time_t start;
+    long period;
+    int n = 0, count = 0, valid, rc = 0;
+    FILE *f;
+
+    f = fopen( name, "r" );
+    if ( f == NULL )
+    {
+        fprintf( stderr, "Error opening %s: %s\n", name, strerror( errno ) );
+        return -1;
+    }
+
+    while ( fgets( line, sizeof( line ), f ) != NULL )
+    {
+        n++;
+        if ( ( p = strchr( line, '#' ) ) != NULL ) *p = 0;
+        for ( p = line + strlen( line ); ( p > line ) && ( p[ -1 ] <= ' ' ); ) *--p = 0;
+        for ( p = line; ( *p == ' ' ) || ( *p == '\t' ); p++ );
+        if ( *p == 0 )
+        {
+            continue;
+        }
+
+        arg = p + strcspn( p, " \t" );
+        if ( *arg != 0 )
+        {
+            *arg++ = 0;
+            arg += strspn( arg, " \t" );
+        }
+
+        period = 0;
+        valid = 0;
+        if ( strcmp( p, "at" ) == 0 )
+        {
+            valid = ( parse_when( arg, &start ) == 0 );
+        }
+        else if ( strcmp( p, "daily" ) == 0 )
+        {
+            valid = ( parse_daily( arg, &start ) == 0 );
+            period = 86400;
+        }
+        else if ( strcmp( p, "every" ) == 0 )
+        {
+            period = strtol( arg, &from, 10 );
+            start = time( NULL ) + period;
+            if ( *from == 0 )
+            {
+                valid = ( period > 0 );
+            }
+            else if ( strncmp( from, " from ", 6 ) == 0 )
+            {
+                valid = ( period > 0 ) && ( parse_when( from + 6, &start ) == 0 );
+            }
+        }
+
+        if ( !valid )
+        {
+            fprintf( stderr, "%s:%d: invalid entry\n", name, n );
+            rc = -1;
+            continue;
+        }
+
+        if ( count == SCHEDULE_ENTRIES )
+        {
+            fprintf( stderr, "%s:%d: more than %d entries\n", name, n, SCHEDULE_ENTRIES );
+            rc = -1;
+            break;
+        }
+        put32( &table[ count * 8 ], start );
+        put32( &table[ count * 8 + 4 ], period );
+        count++;
+    }
+
+    fclose( f );
+    return rc;
+}
+
+
+static int schedule_read( unsigned char *table )
+{
+    unsigned char reg = REG_SCHEDULE;
+
+    if ( i2c_write( &reg, 1 ) != 0 || i2c_read( table, SCHEDULE_SIZE ) != 0 )
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+void cape_schedule_show( void )
+{
+    unsigned char table[ SCHEDULE_SIZE ];
+    uint32_t period;
+    time_t t;
+    int i;
+
+    if ( schedule_read( table ) != 0 )
+    {
+        return;
+    }
+
+    for ( i = 0; i < SCHEDULE_ENTRIES; i++ )
+    {
+        t = get32( &table[ i * 8 ] );
+        period = get32( &table[ i * 8 + 4 ] );
+        if ( t == 0 )
+        {
+            continue;
+        }
+
+        printf( "Scheduled wake %.24s", ctime( &t ) );
+        if ( period == 86400 )
+        {
+            printf( ", daily" );
+        }
+        else if ( period != 0 )
+        {
+            printf( ", every %us", period );
+        }
+        printf( "\n" );
+    }
+}
+
+
+int cape_schedule_upload( const char *name )
+{
+    unsigned char buf[ 1 + SCHEDULE_SIZE ], check[ SCHEDULE_SIZE ];
+
+    if ( cape_capability() < CAPABILITY_SCHEDULE )
+    {
+        fprintf( stderr, "Cape firmware has no wake schedule\n" );
+        return 1;
+    }
+
+    memset( buf, 0, sizeof( buf ) );
+    buf[ 0 ] = REG_SCHEDULE;
+    if ( schedule_load( name, buf + 1 ) != 0 )
+    {
+        return 1;
+    }
+
+    if ( i2c_write( buf, sizeof( buf ) ) != 0 || schedule_read( check ) != 0 )
+    {
+        return 1;
+    }
+    if ( memcmp( buf + 1, check, SCHEDULE_SIZE ) != 0 )
+    {
+        fprintf( stderr, "Schedule read-back differs (entries in the past are dropped)\n" );
+    }
+
+    cape_schedule_show();
+    return 0;
+}
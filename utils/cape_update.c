@@ -0,0 +1,451 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "powercape.h"
+
+// Firmware update
+//
+// Chains the steps that used to be done by hand: switch the application
+// into twiboot, wait for the bootloader to answer at BOOTLOADER_ADDRESS,
+// program the image, read it back, start the application again and check
+// the version it reports.  Both waits poll for an ACK rather than sleeping
+// for a worst-case time.
+//
+// twiboot NACKs the last byte of each flash page and of the start
+// application command, so a NACK there is expected; the read-back and the
+// application answering are what confirm them.  This twiboot programs the
+// page after releasing the bus, so pages go out as one write each with
+// BOOT_PAGE_MS between them, as in avr/twiboot/linux/twi.c.  Verification
+// reads back with combined write/read transactions in large chunks when
+// the adapter supports them.
+
+#define BOOT_CMD_READ_VERSION   0x01
+#define BOOT_CMD_SWITCH_APP     0x01
+#define BOOT_CMD_MEMORY         0x02
+#define BOOT_MEM_CHIPINFO       0x00
+#define BOOT_MEM_FLASH          0x01
+#define BOOT_TYPE_APPLICATION   0x80
+
+#define BOOT_MAX_IMAGE          32768
+#define BOOT_MAX_PAGE           256
+#define BOOT_VERIFY_CHUNK       1024
+#define BOOT_POLL_MS            10
+#define BOOT_PAGE_MS            50          // twiboot programs a page after the STOP
+#define BOOT_ENTER_MS           3000        // Watchdog reset into twiboot
+#define BOOT_START_MS           3000        // Application start-up
+
+static const unsigned char atmega328p_signature[ 3 ] = { 0x1E, 0x95, 0x0F };
+
+static int use_rdwr = 0;
+
+
+static int select_address( int address )
+{
+    if ( ioctl( handle, I2C_SLAVE, address ) < 0 )
+    {
+        fprintf( stderr, "IOCTL Error: %s\n", strerror( errno ) );
+        return -1;
+    }
+    return 0;
+}
+
+
+// Write a command, then read the reply from the bootloader
+static int boot_xfer( unsigned char *cmd, int cmd_len, unsigned char *data, int len )
+{
+    struct i2c_rdwr_ioctl_data xfer;
+    struct i2c_msg msgs[ 2 ];
+
+    if ( !use_rdwr )
+    {
+        if ( write( handle, cmd, cmd_len ) != cmd_len || read( handle, data, len ) != len )
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+    msgs[ 0 ].addr = BOOTLOADER_ADDRESS;
+    msgs[ 0 ].flags = 0;
+    msgs[ 0 ].len = cmd_len;
+    msgs[ 0 ].buf = cmd;
+    msgs[ 1 ].addr = BOOTLOADER_ADDRESS;
+    msgs[ 1 ].flags = I2C_M_RD;
+    msgs[ 1 ].len = len;
+    msgs[ 1 ].buf = data;
+    xfer.msgs = msgs;
+    xfer.nmsgs = 2;
+
+    return ( ioctl( handle, I2C_RDWR, &xfer ) == 2 ) ? 0 : -1;
+}
+
+
+static int boot_read_version( char *version )
+{
+    unsigned char cmd = BOOT_CMD_READ_VERSION;
+    int i;
+
+    memset( version, 0, 17 );
+    if ( boot_xfer( &cmd, 1, (unsigned char*)version, 16 ) != 0 )
+    {
+        return -1;
+    }
+    for ( i = 0; i < 16; i++ )
+    {
+        version[ i ] &= 0x7F;
+    }
+    return ( strncmp( version, "TWIBOOT", 7 ) == 0 ) ? 0 : -1;
+}
+
+
+static int boot_read_memory( int memtype, int address, unsigned char *data, int len )
+{
+    unsigned char cmd[ 4 ];
+
+    cmd[ 0 ] = BOOT_CMD_MEMORY;
+    cmd[ 1 ] = memtype;
+    cmd[ 2 ] = ( address >> 8 ) & 0xFF;
+    cmd[ 3 ] = address & 0xFF;
+
+    return boot_xfer( cmd, 4, data, len );
+}
+
+
+// A write whose last byte twiboot NACKs.  Adapters report a data NACK with
+// different errors, so any NACK is let through.
+static int boot_write_last_nack( unsigned char *buf, int len )
+{
+    if ( write( handle, buf, len ) == len )
+    {
+        return 0;
+    }
+    return ( errno == EREMOTEIO || errno == ENXIO || errno == EIO ) ? 0 : -1;
+}
+
+
+static int boot_write_page( int address, const unsigned char *page, int pagesize )
+{
+    unsigned char buf[ 4 + BOOT_MAX_PAGE ];
+
+    buf[ 0 ] = BOOT_CMD_MEMORY;
+    buf[ 1 ] = BOOT_MEM_FLASH;
+    buf[ 2 ] = ( address >> 8 ) & 0xFF;
+    buf[ 3 ] = address & 0xFF;
+    memcpy( buf + 4, page, pagesize );
+
+    if ( boot_write_last_nack( buf, 4 + pagesize ) != 0 )
+    {
+        return -1;
+    }
+    msleep( BOOT_PAGE_MS );
+    return 0;
+}
+
+
+static int hex_byte( const char *p )
+{
+    unsigned int v;
+
+    if ( sscanf( p, "%2x", &v ) != 1 )
+    {
+        return -1;
+    }
+    return v;
+}
+
+
+// Intel hex as written by avr-objcopy, or a raw binary.  Returns the image
+// length, with gaps filled with 0xFF.
+static int image_load( const char *name, unsigned char *image )
+{
+    char line[ 600 ];
+    int count, type, address, base = 0, length = 0, i, b, sum, n = 0;
+    FILE *f;
+
+    f = fopen( name, "r" );
+    if ( f == NULL )
+    {
+        fprintf( stderr, "Error opening %s: %s\n", name, strerror( errno ) );
+        return -1;
+    }
+    memset( image, 0xFF, BOOT_MAX_IMAGE );
+
+    if ( ( b = fgetc( f ) ) != ':' )
+    {
+        ungetc( b, f );
+        length = fread( image, 1, BOOT_MAX_IMAGE, f );
+        if ( fgetc( f ) != EOF )
+        {
+            fprintf( stderr, "%s: image larger than %d bytes\n", name, BOOT_MAX_IMAGE );
+            length = -1;
+        }
+        fclose( f );
+        return length;
+    }
+    ungetc( b, f );
+
+    while ( fgets( line, sizeof( line ), f ) != NULL )
+    {
+        n++;
+        if ( line[ 0 ] != ':' || ( count = hex_byte( line + 1 ) ) < 0 ||
+             (int)strlen( line ) < 11 + count * 2 )
+        {
+            fprintf( stderr, "%s:%d: invalid record\n", name, n );
+            fclose( f );
+            return -1;
+        }
+
+        sum = 0;
+        for ( i = 0; i < count + 5; i++ )
+        {
+            sum += hex_byte( line + 1 + i * 2 );
+        }
+        if ( ( sum & 0xFF ) != 0 )
+        {
+            fprintf( stderr, "%s:%d: checksum error\n", name, n );
+            fclose( f );
+            return -1;
+        }
+
+        address = ( hex_byte( line + 3 ) << 8 ) | hex_byte( line + 5 );
+        type = hex_byte( line + 7 );
+        if ( type == 0x01 )
+        {
+            break;
+        }
+        if ( type == 0x02 && count == 2 )
+        {
+            base = ( ( hex_byte( line + 9 ) << 8 ) | hex_byte( line + 11 ) ) << 4;
+            continue;
+        }
+        if ( type != 0x00 )
+        {
+            continue;
+        }
+
+        if ( base + address + count > BOOT_MAX_IMAGE )
+        {
+            fprintf( stderr, "%s:%d: address beyond %d bytes\n", name, n, BOOT_MAX_IMAGE );
+            fclose( f );
+            return -1;
+        }
+        for ( i = 0; i < count; i++ )
+        {
+            image[ base + address + i ] = hex_byte( line + 9 + i * 2 );
+        }
+        if ( base + address + count > length )
+        {
+            length = base + address + count;
+        }
+    }
+
+    fclose( f );
+    return length;
+}
+
+
+// Poll until the bootloader answers
+static int wait_bootloader( char *version )
+{
+    int ms;
+
+    for ( ms = 0; ms < BOOT_ENTER_MS; ms += BOOT_POLL_MS )
+    {
+        if ( boot_read_version( version ) == 0 )
+        {
+            return ms;
+        }
+        msleep( BOOT_POLL_MS );
+    }
+    return -1;
+}
+
+
+// Register read that stays quiet, since a NACK is expected while polling
+static int app_read( unsigned char reg, unsigned char *data, int len )
+{
+    if ( write( handle, &reg, 1 ) != 1 || read( handle, data, len ) != len )
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+// Poll until the application answers on the register interface
+static int wait_application( void )
+{
+    unsigned char id[ 2 ];
+    int ms;
+
+    for ( ms = 0; ms < BOOT_START_MS; ms += BOOT_POLL_MS )
+    {
+        if ( app_read( REG_EXTENDED, id, 2 ) == 0 && id[ 0 ] == 0x69 )
+        {
+            return ms;
+        }
+        msleep( BOOT_POLL_MS );
+    }
+    return -1;
+}
+
+
+static void read_version( int *major, int *minor )
+{
+    unsigned char id[ 2 ], version[ 2 ];
+
+    *major = *minor = -1;
+    if ( app_read( REG_EXTENDED, id, 2 ) == 0 && id[ 0 ] == 0x69 &&
+         id[ 1 ] >= CAPABILITY_VERSION && app_read( REG_VERSION_MAJOR, version, 2 ) == 0 )
+    {
+        *major = version[ 0 ];
+        *minor = version[ 1 ];
+    }
+}
+
+
+int cape_update( const char *name )
+{
+    static unsigned char image[ BOOT_MAX_IMAGE ], check[ BOOT_MAX_IMAGE ];
+    unsigned char chipinfo[ 8 ], cmd[ 2 ];
+    unsigned long funcs;
+    char version[ 17 ];
+    int length, pagesize, flashsize, address, chunk, ms;
+    int old_major, old_minor, major, minor;
+    struct timespec t0, t1;
+
+    length = image_load( name, image );
+    if ( length <= 0 )
+    {
+        if ( length == 0 )
+        {
+            fprintf( stderr, "%s: empty image\n", name );
+        }
+        return 1;
+    }
+
+    use_rdwr = ( ioctl( handle, I2C_FUNCS, &funcs ) == 0 ) && ( funcs & I2C_FUNC_I2C );
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+
+    // The cape may already be sitting in the bootloader, e.g. after a
+    // failed update, in which case this picks up from there
+    read_version( &old_major, &old_minor );
+    if ( select_address( BOOTLOADER_ADDRESS ) != 0 )
+    {
+        return 1;
+    }
+    if ( boot_read_version( version ) != 0 )
+    {
+        if ( select_address( avr_address ) != 0 )
+        {
+            return 1;
+        }
+        if ( register_write( REG_CONTROL, CONTROL_BOOTLOAD ) != 0 )
+        {
+            fprintf( stderr, "Unable to switch to cape bootloader\n" );
+            return 1;
+        }
+        if ( select_address( BOOTLOADER_ADDRESS ) != 0 )
+        {
+            return 1;
+        }
+        if ( ( ms = wait_bootloader( version ) ) < 0 )
+        {
+            fprintf( stderr, "Bootloader did not answer at 0x%02X\n", BOOTLOADER_ADDRESS );
+            return 1;
+        }
+        printf( "Entered %s after %dms\n", version, ms );
+    }
+
+    if ( boot_read_memory( BOOT_MEM_CHIPINFO, 0, chipinfo, sizeof( chipinfo ) ) != 0 )
+    {
+        fprintf( stderr, "Unable to read chip info: %s\n", strerror( errno ) );
+        return 1;
+    }
+    pagesize = chipinfo[ 3 ];
+    flashsize = ( chipinfo[ 4 ] << 8 ) | chipinfo[ 5 ];
+    if ( memcmp( chipinfo, atmega328p_signature, 3 ) != 0 || pagesize == 0 || pagesize > BOOT_MAX_PAGE )
+    {
+        fprintf( stderr, "Unexpected chip %02X %02X %02X, page size %d\n",
+                 chipinfo[ 0 ], chipinfo[ 1 ], chipinfo[ 2 ], pagesize );
+        return 1;
+    }
+    if ( length > flashsize )
+    {
+        fprintf( stderr, "%s: %d bytes does not fit in %d bytes of application flash\n", name, length, flashsize );
+        return 1;
+    }
+
+    length = ( length + pagesize - 1 ) / pagesize * pagesize;
+    for ( address = 0; address < length; address += pagesize )
+    {
+        if ( boot_write_page( address, &image[ address ], pagesize ) != 0 )
+        {
+            fprintf( stderr, "Flash write failed at 0x%04X: %s\n", address, strerror( errno ) );
+            return 1;
+        }
+    }
+
+    for ( address = 0; address < length; address += chunk )
+    {
+        chunk = ( length - address < BOOT_VERIFY_CHUNK ) ? length - address : BOOT_VERIFY_CHUNK;
+        if ( boot_read_memory( BOOT_MEM_FLASH, address, &check[ address ], chunk ) != 0 )
+        {
+            fprintf( stderr, "Flash read failed at 0x%04X: %s\n", address, strerror( errno ) );
+            return 1;
+        }
+    }
+    for ( address = 0; address < length; address++ )
+    {
+        if ( check[ address ] != image[ address ] )
+        {
+            fprintf( stderr, "Verify failed at 0x%04X: wrote 0x%02X, read 0x%02X\n",
+                     address, image[ address ], check[ address ] );
+            return 1;
+        }
+    }
+    printf( "Programmed and verified %d bytes\n", length );
+
+    cmd[ 0 ] = BOOT_CMD_SWITCH_APP;
+    cmd[ 1 ] = BOOT_TYPE_APPLICATION;
+    if ( boot_write_last_nack( cmd, 2 ) != 0 )
+    {
+        fprintf( stderr, "Unable to start application: %s\n", strerror( errno ) );
+        return 1;
+    }
+
+    if ( select_address( avr_address ) != 0 )
+    {
+        return 1;
+    }
+    if ( wait_application() < 0 )
+    {
+        fprintf( stderr, "Application did not answer at 0x%02X\n", avr_address );
+        return 1;
+    }
+    read_version( &major, &minor );
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+
+    if ( major < 0 )
+    {
+        fprintf( stderr, "Application running, but reports no version\n" );
+        return 1;
+    }
+    if ( old_major >= 0 )
+    {
+        printf( "Firmware %d.%d -> %d.%d", old_major, old_minor, major, minor );
+    }
+    else
+    {
+        printf( "Firmware %d.%d", major, minor );
+    }
+    printf( " in %.1fs\n", ( t1.tv_sec - t0.tv_sec ) + ( t1.tv_nsec - t0.tv_nsec ) / 1e9 );
+
+    return 0;
+}
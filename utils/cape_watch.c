@@ -0,0 +1,238 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "powercape.h"
+
+// Register watcher
+//
+// Polls the whole register file with one combined write/read transaction
+// and prints the fields that differ from the previous snapshot.  Any host
+// access counts as activity for the start-up watchdog, so watching keeps
+// it from firing.
+
+static volatile sig_atomic_t watch_running = 1;
+
+static const char *status_names[] = { "pgood", "button", "opto", "low_supply", NULL };
+static const char *start_names[] = { "button", "external", "pwrgood", "timeout", "alarm", NULL };
+static const char *control_names[] = { "ce", "led0", "led1", "no_ce_start", "button_pass", "", "", "bootload", NULL };
+
+
+static void watch_stop( int sig )
+{
+    watch_running = 0;
+}
+
+
+// Number of registers the firmware answers for before the index wraps.
+// REG_SCHEDULE is a port and is skipped by snapshot(); the
+// REG_LATENCY_HISTORY port is left past the end.
+int cape_register_count( int capability )
+{
+    if ( capability >= CAPABILITY_LATENCY ) return REG_LATENCY_ATTEMPTS + 1;
+    if ( capability >= CAPABILITY_SHUTDOWN ) return REG_SHUTDOWN_STATUS + 1;
+    if ( capability >= CAPABILITY_SUPPLY ) return REG_SUPPLY_RESTART + 1;
+    if ( capability >= CAPABILITY_EEPROM_QUEUE ) return REG_EEPROM_STATUS + 1;
+    if ( capability >= CAPABILITY_SCHEDULE ) return REG_SCHEDULE;
+    if ( capability >= CAPABILITY_ALARM ) return REG_ALARM_3 + 1;
+    if ( capability >= CAPABILITY_RTC_TRIM ) return REG_RTC_TRIM_1 + 1;
+    if ( capability >= CAPABILITY_RTC_FRAC ) return REG_SECONDS_FRAC + 1;
+    if ( capability >= CAPABILITY_VERSION ) return REG_RESTART_CE_SECONDS + 1;
+    if ( capability >= CAPABILITY_WDT ) return REG_I2C_TCHARGE + 1;
+    return REG_SECONDS_3 + 1;
+}
+
+
+// A burst stops advancing at the schedule port, so the registers after it
+// are a second write/read pair in the same transaction
+static int snapshot( unsigned char *regs, int count )
+{
+    struct i2c_rdwr_ioctl_data xfer;
+    struct i2c_msg msgs[ 4 ];
+    unsigned char reg[ 2 ] = { 0, REG_SCHEDULE + 1 };
+    int i, n = ( count > REG_SCHEDULE + 1 ) ? 2 : 1;
+
+    for ( i = 0; i < n; i++ )
+    {
+        msgs[ i * 2 ].addr = avr_address;
+        msgs[ i * 2 ].flags = 0;
+        msgs[ i * 2 ].len = 1;
+        msgs[ i * 2 ].buf = &reg[ i ];
+        msgs[ i * 2 + 1 ].addr = avr_address;
+        msgs[ i * 2 + 1 ].flags = I2C_M_RD;
+        msgs[ i * 2 + 1 ].buf = &regs[ reg[ i ] ];
+    }
+    msgs[ 1 ].len = ( n == 2 ) ? REG_SCHEDULE : count;
+    msgs[ 3 ].len = count - ( REG_SCHEDULE + 1 );
+    regs[ REG_SCHEDULE ] = 0;
+    xfer.msgs = msgs;
+    xfer.nmsgs = n * 2;
+
+    if ( ioctl( handle, I2C_RDWR, &xfer ) != n * 2 )
+    {
+        fprintf( stderr, "I2C transfer failed: %s\n", strerror( errno ) );
+        return -1;
+    }
+    return 0;
+}
+
+
+static void print_flags( const char *label, unsigned char value, const char **names )
+{
+    int i, first = 1;
+
+    printf( " %s=", label );
+    for ( i = 0; names[ i ] != NULL; i++ )
+    {
+        if ( ( value & ( 1 << i ) ) && names[ i ][ 0 ] )
+        {
+            printf( "%s%s", first ? "" : ",", names[ i ] );
+            first = 0;
+        }
+    }
+    if ( first )
+    {
+        printf( "-" );
+    }
+}
+
+
+static void print_time( int64_t real_ns )
+{
+    time_t t = real_ns / 1000000000LL;
+    struct tm *tmptr = localtime( &t );
+
+    printf( "%04d-%02d-%02d %2d:%02d:%02d.%03d",
+            tmptr->tm_year + 1900, tmptr->tm_mon + 1, tmptr->tm_mday,
+            tmptr->tm_hour, tmptr->tm_min, tmptr->tm_sec,
+            (int)( ( real_ns / 1000000 ) % 1000 ) );
+}
+
+
+static uint32_t get32( const unsigned char *p )
+{
+    return p[ 0 ] | ( p[ 1 ] << 8 ) | ( p[ 2 ] << 16 ) | ( (uint32_t)p[ 3 ] << 24 );
+}
+
+
+int cape_watch( int interval_ms )
+{
+    unsigned char prev[ NUM_REGISTERS ], cur[ NUM_REGISTERS ];
+    struct timespec next, now;
+    int64_t prev_ns, now_ns;
+    int capability, count, reg, changed, first = 1;
+    time_t rtc;
+
+    capability = cape_capability();
+    if ( capability < 0 )
+    {
+        fprintf( stderr, "No extended cape registers found\n" );
+        return 1;
+    }
+    count = cape_register_count( capability );
+
+    signal( SIGTERM, watch_stop );
+    signal( SIGINT, watch_stop );
+
+    clock_gettime( CLOCK_MONOTONIC, &next );
+    prev_ns = 0;
+
+    while ( watch_running )
+    {
+        if ( snapshot( cur, count ) != 0 )
+        {
+            return 1;
+        }
+        clock_gettime( CLOCK_REALTIME, &now );
+        now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+        changed = first;
+        for ( reg = 0; !changed && reg < count; reg++ )
+        {
+            if ( reg == REG_SECONDS_FRAC || ( reg >= REG_SECONDS_0 && reg <= REG_SECONDS_3 ) ||
+                 reg == REG_SUPPLY_0 || reg == REG_SUPPLY_1 )
+            {
+                continue;
+            }
+            changed = ( cur[ reg ] != prev[ reg ] );
+        }
+
+        // The RTC only counts as a change when it jumps against our clock
+        rtc = get32( &cur[ REG_SECONDS_0 ] );
+        if ( !first && llabs( ( (int64_t)rtc - get32( &prev[ REG_SECONDS_0 ] ) ) * 1000000000LL -
+                              ( now_ns - prev_ns ) ) > 1500000000LL )
+        {
+            changed = 1;
+        }
+
+        if ( changed )
+        {
+            print_time( now_ns );
+            if ( first || cur[ REG_STATUS ] != prev[ REG_STATUS ] )
+            {
+                print_flags( "status", cur[ REG_STATUS ], status_names );
+            }
+            if ( first || cur[ REG_CONTROL ] != prev[ REG_CONTROL ] )
+            {
+                print_flags( "control", cur[ REG_CONTROL ], control_names );
+            }
+            if ( first || cur[ REG_START_ENABLE ] != prev[ REG_START_ENABLE ] )
+            {
+                print_flags( "enable", cur[ REG_START_ENABLE ], start_names );
+            }
+            if ( first || cur[ REG_START_REASON ] != prev[ REG_START_REASON ] )
+            {
+                print_flags( "reason", cur[ REG_START_REASON ], start_names );
+            }
+            if ( first || memcmp( &cur[ REG_RESTART_HOURS ], &prev[ REG_RESTART_HOURS ], 3 ) )
+            {
+                printf( " restart=%d:%02d:%02d", cur[ REG_RESTART_HOURS ], cur[ REG_RESTART_MINUTES ], cur[ REG_RESTART_SECONDS ] );
+            }
+            if ( capability >= CAPABILITY_WDT &&
+                 ( first || memcmp( &cur[ REG_WDT_RESET ], &prev[ REG_WDT_RESET ], 4 ) ) )
+            {
+                printf( " wdt=%d/%d/%d/%d", cur[ REG_WDT_RESET ], cur[ REG_WDT_POWER ], cur[ REG_WDT_STOP ], cur[ REG_WDT_START ] );
+            }
+            if ( capability >= CAPABILITY_SUPPLY )
+            {
+                printf( " supply=%dmV", cur[ REG_SUPPLY_0 ] | ( cur[ REG_SUPPLY_1 ] << 8 ) );
+            }
+            printf( " rtc=%.24s", ctime( &rtc ) );
+
+            for ( reg = 0; !first && reg < count; reg++ )
+            {
+                if ( ( reg < REG_START_REASON + 1 && reg != REG_MCUSR && reg != REG_OSCCAL ) ||
+                     ( reg >= REG_RESTART_HOURS && reg <= REG_SECONDS_3 ) ||
+                     ( reg >= REG_WDT_RESET && reg <= REG_WDT_START ) ||
+                     reg == REG_SECONDS_FRAC || reg == REG_SUPPLY_0 || reg == REG_SUPPLY_1 )
+                {
+                    continue;
+                }
+                if ( cur[ reg ] != prev[ reg ] )
+                {
+                    printf( " r%d=0x%02X", reg, cur[ reg ] );
+                }
+            }
+            printf( "\n" );
+            fflush( stdout );
+        }
+
+        memcpy( prev, cur, count );
+        prev_ns = now_ns;
+        first = 0;
+
+        next.tv_nsec += ( interval_ms % 1000 ) * 1000000L;
+        next.tv_sec += interval_ms / 1000 + next.tv_nsec / 1000000000L;
+        next.tv_nsec %= 1000000000L;
+        clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL );
+    }
+
+    return 0;
+}
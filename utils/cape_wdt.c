@@ -0,0 +1,479 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "powercape.h"
+
+// Watchdog kicker
+//
+// Arms the cape reset and power-cycle watchdogs from a config file and
+// feeds them from a timerfd while every health probe passes.  A feed is a
+// single write of REG_WDT_RESET and REG_WDT_POWER, so the cape sees both
+// countdowns reloaded in one transaction.  If a probe fails the feed is
+// skipped and the cape recovers the board when the countdown runs out.
+//
+// Config file, one setting per line, '#' starts a comment:
+//
+//   reset = <seconds>          Reset watchdog (REG_WDT_RESET), 0 = off
+//   power = <seconds>          Power-cycle watchdog (REG_WDT_POWER), 0 = off
+//   start = <seconds>          Start-up activity watchdog (REG_WDT_START)
+//   interval = <seconds>       Feed period
+//   disarm = 0|1               Clear the watchdogs on SIGTERM/SIGINT (default 1)
+//   probe = process <name>     A process with this name is running (only
+//                              the first 15 characters are compared)
+//   probe = pidfile <path>     The pid in <path> is alive
+//   probe = file <path> <age>  <path> was modified within <age> seconds
+//   probe = tcp <ip>:<port>    A TCP connect succeeds
+//   probe = unix <path>        A unix stream socket accepts a connection
+
+#define WDT_MAX_PROBES      16
+#define WDT_PROBE_TIMEOUT   500     // ms for socket probes
+#define WDT_COMM_LEN        15      // The kernel truncates /proc/<pid>/comm
+
+typedef enum
+{
+    PROBE_PROCESS,
+    PROBE_PIDFILE,
+    PROBE_FILE,
+    PROBE_TCP,
+    PROBE_UNIX
+} probe_type;
+
+typedef struct
+{
+    probe_type type;
+    char arg[ 108 ];
+    int max_age;
+    struct sockaddr_in addr;
+} probe_entry;
+
+typedef struct
+{
+    int reset;
+    int power;
+    int start;
+    int interval;
+    int disarm;
+    int probes;
+    probe_entry probe[ WDT_MAX_PROBES ];
+} wdt_config;
+
+static volatile sig_atomic_t wdt_running = 1;
+
+
+static void wdt_stop( int sig )
+{
+    wdt_running = 0;
+}
+
+
+static int parse_seconds( const char *value, int max, int *out )
+{
+    char *end;
+    long v = strtol( value, &end, 0 );
+
+    if ( ( end == value ) || ( *end != 0 ) || ( v < 0 ) || ( v > max ) )
+    {
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+
+static int parse_probe( wdt_config *cfg, char *value )
+{
+    probe_entry *p;
+    char *kind, *arg, *extra, *colon;
+
+    if ( cfg->probes == WDT_MAX_PROBES )
+    {
+        fprintf( stderr, "Too many probes (max %d)\n", WDT_MAX_PROBES );
+        return -1;
+    }
+    p = &cfg->probe[ cfg->probes ];
+    memset( p, 0, sizeof( *p ) );
+
+    kind = strtok( value, " \t" );
+    arg = strtok( NULL, " \t" );
+    extra = strtok( NULL, " \t" );
+    if ( ( kind == NULL ) || ( arg == NULL ) || ( strlen( arg ) >= sizeof( p->arg ) ) )
+    {
+        return -1;
+    }
+    strcpy( p->arg, arg );
+
+    if ( strcmp( kind, "process" ) == 0 )
+    {
+        p->type = PROBE_PROCESS;
+    }
+    else if ( strcmp( kind, "pidfile" ) == 0 )
+    {
+        p->type = PROBE_PIDFILE;
+    }
+    else if ( strcmp( kind, "file" ) == 0 )
+    {
+        p->type = PROBE_FILE;
+        if ( ( extra == NULL ) || parse_seconds( extra, 0x7FFFFFFF, &p->max_age ) )
+        {
+            return -1;
+        }
+    }
+    else if ( strcmp( kind, "tcp" ) == 0 )
+    {
+        p->type = PROBE_TCP;
+        colon = strrchr( arg, ':' );
+        if ( colon == NULL )
+        {
+            return -1;
+        }
+        *colon = 0;
+        p->addr.sin_family = AF_INET;
+        p->addr.sin_port = htons( atoi( colon + 1 ) );
+        if ( inet_pton( AF_INET, arg, &p->addr.sin_addr ) != 1 )
+        {
+            return -1;
+        }
+        *colon = ':';
+    }
+    else if ( strcmp( kind, "unix" ) == 0 )
+    {
+        p->type = PROBE_UNIX;
+    }
+    else
+    {
+        return -1;
+    }
+
+    cfg->probes++;
+    return 0;
+}
+
+
+static int wdt_load( const char *name, wdt_config *cfg )
+{
+    char line[ 256 ];
+    char *key, *value, *eq, *end;
+    int n = 0, rc = 0;
+    FILE *f;
+
+    memset( cfg, 0, sizeof( *cfg ) );
+    cfg->interval = 10;
+    cfg->disarm = 1;
+
+    f = fopen( name, "r" );
+    if ( f == NULL )
+    {
+        fprintf( stderr, "Error opening %s: %s\n", name, strerror( errno ) );
+        return -1;
+    }
+
+    while ( fgets( line, sizeof( line ), f ) != NULL )
+    {
+        n++;
+        if ( ( end = strchr( line, '#' ) ) != NULL ) *end = 0;
+        for ( end = line + strlen( line ); ( end > line ) && ( end[ -1 ] <= ' ' ); ) *--end = 0;
+        for ( key = line; ( *key == ' ' ) || ( *key == '\t' ); key++ );
+        if ( *key == 0 )
+        {
+            continue;
+        }
+
+        eq = strchr( key, '=' );
+        if ( eq == NULL )
+        {
+            fprintf( stderr, "%s:%d: expected key = value\n", name, n );
+            rc = -1;
+            continue;
+        }
+        for ( end = eq; ( end > key ) && ( end[ -1 ] <= ' ' ); ) end--;
+        *end = 0;
+        for ( value = eq + 1; ( *value == ' ' ) || ( *value == '\t' ); value++ );
+
+        if ( ( strcmp( key, "reset" ) == 0 && parse_seconds( value, 255, &cfg->reset ) == 0 ) ||
+             ( strcmp( key, "power" ) == 0 && parse_seconds( value, 255, &cfg->power ) == 0 ) ||
+             ( strcmp( key, "start" ) == 0 && parse_seconds( value, 255, &cfg->start ) == 0 ) ||
+             ( strcmp( key, "interval" ) == 0 && parse_seconds( value, 255, &cfg->interval ) == 0 ) ||
+             ( strcmp( key, "disarm" ) == 0 && parse_seconds( value, 1, &cfg->disarm ) == 0 ) ||
+             ( strcmp( key, "probe" ) == 0 && parse_probe( cfg, value ) == 0 ) )
+        {
+            continue;
+        }
+
+        fprintf( stderr, "%s:%d: invalid setting '%s'\n", name, n, key );
+        rc = -1;
+    }
+    fclose( f );
+
+    if ( cfg->interval == 0 )
+    {
+        fprintf( stderr, "%s: interval must be at least 1 second\n", name );
+        rc = -1;
+    }
+    if ( ( cfg->reset && ( cfg->interval >= cfg->reset ) ) ||
+         ( cfg->power && ( cfg->interval >= cfg->power ) ) )
+    {
+        fprintf( stderr, "%s: interval must be shorter than the watchdog timeouts\n", name );
+        rc = -1;
+    }
+
+    return rc;
+}
+
+
+static int probe_process( const char *name )
+{
+    char path[ 6 + 256 + 6 ], comm[ 64 ];
+    struct dirent *d;
+    DIR *dir;
+    int fd, n, found = 0;
+
+    dir = opendir( "/proc" );
+    if ( dir == NULL )
+    {
+        return 0;
+    }
+
+    while ( !found && ( d = readdir( dir ) ) != NULL )
+    {
+        if ( ( d->d_name[ 0 ] < '1' ) || ( d->d_name[ 0 ] > '9' ) )
+        {
+            continue;
+        }
+        snprintf( path, sizeof( path ), "/proc/%s/comm", d->d_name );
+        fd = open( path, O_RDONLY );
+        if ( fd < 0 )
+        {
+            continue;
+        }
+        n = read( fd, comm, sizeof( comm ) - 1 );
+        close( fd );
+        if ( n > 0 )
+        {
+            comm[ n ] = 0;
+            comm[ strcspn( comm, "\n" ) ] = 0;
+            found = ( strncmp( comm, name, WDT_COMM_LEN ) == 0 );
+        }
+    }
+
+    closedir( dir );
+    return found;
+}
+
+
+static int probe_pidfile( const char *name )
+{
+    FILE *f = fopen( name, "r" );
+    int pid = 0;
+
+    if ( f == NULL )
+    {
+        return 0;
+    }
+    if ( fscanf( f, "%d", &pid ) != 1 )
+    {
+        pid = 0;
+    }
+    fclose( f );
+
+    return ( pid > 0 ) && ( ( kill( pid, 0 ) == 0 ) || ( errno == EPERM ) );
+}
+
+
+static int probe_file( const char *name, int max_age )
+{
+    struct stat st;
+
+    if ( stat( name, &st ) != 0 )
+    {
+        return 0;
+    }
+    return ( time( NULL ) - st.st_mtime ) <= max_age;
+}
+
+
+static int probe_connect( int domain, const struct sockaddr *addr, socklen_t len )
+{
+    struct pollfd pfd;
+    socklen_t sl = sizeof( int );
+    int fd, err = 1;
+
+    fd = socket( domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( fd < 0 )
+    {
+        return 0;
+    }
+
+    if ( connect( fd, addr, len ) == 0 )
+    {
+        err = 0;
+    }
+    else if ( errno == EINPROGRESS )
+    {
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if ( poll( &pfd, 1, WDT_PROBE_TIMEOUT ) == 1 )
+        {
+            getsockopt( fd, SOL_SOCKET, SO_ERROR, &err, &sl );
+        }
+    }
+
+    close( fd );
+    return err == 0;
+}
+
+
+static int probe_check( const probe_entry *p )
+{
+    struct sockaddr_un un;
+
+    switch ( p->type )
+    {
+        case PROBE_PROCESS:
+            return probe_process( p->arg );
+
+        case PROBE_PIDFILE:
+            return probe_pidfile( p->arg );
+
+        case PROBE_FILE:
+            return probe_file( p->arg, p->max_age );
+
+        case PROBE_TCP:
+            return probe_connect( AF_INET, (const struct sockaddr*)&p->addr, sizeof( p->addr ) );
+
+        case PROBE_UNIX:
+            memset( &un, 0, sizeof( un ) );
+            un.sun_family = AF_UNIX;
+            strncpy( un.sun_path, p->arg, sizeof( un.sun_path ) - 1 );
+            return probe_connect( AF_UNIX, (const struct sockaddr*)&un, sizeof( un ) );
+    }
+
+    return 0;
+}
+
+
+// Reload both countdowns with one transaction
+static int wdt_feed( int reset, int power )
+{
+    unsigned char buf[ 3 ];
+
+    buf[ 0 ] = REG_WDT_RESET;
+    buf[ 1 ] = reset;
+    buf[ 2 ] = power;
+
+    return i2c_write( buf, sizeof( buf ) );
+}
+
+
+int cape_wdt_daemon( const char *config )
+{
+    struct itimerspec its;
+    struct sigaction sa;
+    wdt_config cfg;
+    uint64_t expirations;
+    int tfd, i, healthy, was_healthy = 1;
+
+    if ( wdt_load( config, &cfg ) != 0 )
+    {
+        return 1;
+    }
+
+    if ( cape_capability() < CAPABILITY_WDT )
+    {
+        fprintf( stderr, "Cape firmware has no watchdog support\n" );
+        return 1;
+    }
+
+    tfd = timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC );
+    if ( tfd < 0 )
+    {
+        fprintf( stderr, "timerfd: %s\n", strerror( errno ) );
+        return 1;
+    }
+    its.it_value.tv_sec = cfg.interval;
+    its.it_value.tv_nsec = 0;
+    its.it_interval = its.it_value;
+    timerfd_settime( tfd, 0, &its, NULL );
+
+    // No SA_RESTART, so a stop interrupts the timerfd wait instead of
+    // running on to one more feed
+    memset( &sa, 0, sizeof( sa ) );
+    sa.sa_handler = wdt_stop;
+    sigemptyset( &sa.sa_mask );
+    sigaction( SIGTERM, &sa, NULL );
+    sigaction( SIGINT, &sa, NULL );
+    signal( SIGPIPE, SIG_IGN );
+
+    // Arm
+    if ( ( register_write( REG_WDT_START, cfg.start ) != 0 ) ||
+         ( wdt_feed( cfg.reset, cfg.power ) != 0 ) )
+    {
+        close( tfd );
+        return 1;
+    }
+    fprintf( stderr, "Watchdog armed: reset %d, power %d, start %d, feeding every %ds with %d probes\n",
+             cfg.reset, cfg.power, cfg.start, cfg.interval, cfg.probes );
+
+    while ( wdt_running )
+    {
+        if ( read( tfd, &expirations, sizeof( expirations ) ) != sizeof( expirations ) )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            fprintf( stderr, "timerfd read: %s\n", strerror( errno ) );
+            break;
+        }
+
+        healthy = 1;
+        for ( i = 0; ( i < cfg.probes ) && healthy; i++ )
+        {
+            if ( !probe_check( &cfg.probe[ i ] ) )
+            {
+                if ( was_healthy )
+                {
+                    fprintf( stderr, "Probe %s %s failed, not feeding watchdog\n",
+                             cfg.probe[ i ].type == PROBE_PROCESS ? "process" :
+                             cfg.probe[ i ].type == PROBE_PIDFILE ? "pidfile" :
+                             cfg.probe[ i ].type == PROBE_FILE ? "file" :
+                             cfg.probe[ i ].type == PROBE_TCP ? "tcp" : "unix",
+                             cfg.probe[ i ].arg );
+                }
+                healthy = 0;
+            }
+        }
+
+        if ( healthy && wdt_running )
+        {
+            if ( !was_healthy )
+            {
+                fprintf( stderr, "Probes healthy again, feeding watchdog\n" );
+            }
+            wdt_feed( cfg.reset, cfg.power );
+        }
+        was_healthy = healthy;
+    }
+
+    if ( cfg.disarm )
+    {
+        wdt_feed( 0, 0 );
+        fprintf( stderr, "Watchdog disarmed\n" );
+    }
+
+    close( tfd );
+    return 0;
+}
@@ -1,16 +1,22 @@
 #include <unistd.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <endian.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <linux/i2c-dev.h>
+#include "sample.h"
+#include "trace_codec.h"
+#include "trace_proc.h"
+#include "trace_period.h"
 
 #define CONFIG_REG          0
 #define SHUNT_REG           1
@@ -27,6 +33,7 @@ typedef enum {
     OP_VOLTAGE,
     OP_CURRENT,
     OP_MONITOR,
+    OP_EXPAND,
     OP_NONE
 } op_type;
 
@@ -37,6 +44,14 @@ int i2c_bus = 2;
 int i2c_address = INA_ADDRESS;
 int handle;
 int whole_numbers = 0;
+int timestamps = 0;
+char *trace_name = NULL;
+trace_writer trace;
+volatile sig_atomic_t running = 1;
+proc_config config;
+proc_state proc;
+period_state period;
+int periodic = 0;
 
 
 void msleep( int msecs )
@@ -117,10 +132,15 @@ void show_usage( char *progname )
     fprintf( stderr, "      -h --help           Show usage.\n" );
     fprintf( stderr, "      -i --interval       Set interval for monitor mode.\n" );
     fprintf( stderr, "      -w --whole          Show whole numbers only. Useful for scripts.\n" );
+    fprintf( stderr, "      -o --output <file>  Append monitor samples to compressed trace <file>.\n" );
+    fprintf( stderr, "      -x --expand <file>  Print samples from compressed trace <file>.\n" );
+    fprintf( stderr, "      -t --timestamps     Prefix samples with realtime/monotonic ns and bus time.\n" );
     fprintf( stderr, "      -v --voltage        Show battery voltage in mV.\n" );
     fprintf( stderr, "      -c --current        Show battery current in mA.\n" );
     fprintf( stderr, "      -a --address <addr> Override I2C address of INA219 from default of 0x%02X.\n", i2c_address );
     fprintf( stderr, "      -b --bus <i2c bus>  Override I2C bus from default of %d.\n", i2c_bus );
+    fprintf( stderr, "      -p --periodic       Detect periodic loads and their energy.\n" );
+    proc_usage();
     exit( 1 );
 }
 
@@ -136,17 +156,30 @@ void parse( int argc, char *argv[] )
             { "current",    0, 0, 'c' },
             { "help",       0, 0, 'h' },
             { "interval",   0, 0, 'i' },
+            { "output",     1, 0, 'o' },
+            { "timestamps", 0, 0, 't' },
             { "voltage",    0, 0, 'v' },
             { "whole",      0, 0, 'w' },
+            { "expand",     1, 0, 'x' },
+            { "periodic",   0, 0, 'p' },
+            PROC_LONG_OPTIONS,
             { NULL,         0, 0, 0 },
         };
         int c;
 
-        c = getopt_long( argc, argv, "a:b:chi:vw", lopts, NULL );
+        c = getopt_long( argc, argv, "a:b:chi:o:ptvwx:" PROC_OPTSTRING, lopts, NULL );
 
         if( c == -1 )
             break;
 
+        switch ( proc_parse_option( &config, c, optarg ) )
+        {
+            case 1:
+                continue;
+            case -1:
+                exit( 1 );
+        }
+
         switch( c )
         {
             case 'a':
@@ -199,6 +232,31 @@ void parse( int argc, char *argv[] )
                 break;
             }
 
+            case 'o':
+            {
+                trace_name = optarg;
+                break;
+            }
+
+            case 'x':
+            {
+                operation = OP_EXPAND;
+                trace_name = optarg;
+                break;
+            }
+
+            case 'p':
+            {
+                periodic = 1;
+                break;
+            }
+
+            case 't':
+            {
+                timestamps = 1;
+                break;
+            }
+
             case 'v':
             {
                 operation = OP_VOLTAGE;
@@ -215,44 +273,68 @@ void parse( int argc, char *argv[] )
 }
 
 
-int get_voltage( float *mv )
+int64_t clock_ns( clockid_t clock )
 {
-    short bus;
+    struct timespec ts;
 
-    if ( register_read( BUS_REG, (unsigned short*)&bus ) != 0 )
+    clock_gettime( clock, &ts );
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+// Read shunt and bus registers as one sample.  Both clocks are taken before
+// and after the bus traffic so the sample is tagged with the midpoint, and
+// the transaction duration is kept to expose slow or stretched transfers.
+int sample_read( sample_type *s )
+{
+    int64_t mono0, real0, mono1, real1;
+    int rc;
+
+    mono0 = clock_ns( CLOCK_MONOTONIC_RAW );
+    real0 = clock_ns( CLOCK_REALTIME );
+
+    rc = register_read( SHUNT_REG, (unsigned short*)&s->shunt );
+    if ( rc == 0 )
     {
-        return -1;
+        rc = register_read( BUS_REG, (unsigned short*)&s->bus );
     }
 
-    *mv = ( float )( ( bus & 0xFFF8 ) >> 1 );
-    return 0;
+    real1 = clock_ns( CLOCK_REALTIME );
+    mono1 = clock_ns( CLOCK_MONOTONIC_RAW );
+
+    s->mono_ns = mono0 + ( mono1 - mono0 ) / 2;
+    s->real_ns = real0 + ( real1 - real0 ) / 2;
+    s->duration_ns = mono1 - mono0;
+
+    return rc;
 }
 
 
-int get_current( float *ma )
+void show_timestamp( const sample_type *s )
 {
-    short shunt;
-
-    if ( register_read( SHUNT_REG, &shunt ) != 0 )
+    if ( timestamps )
     {
-        return -1;
+        printf( "%lld.%09lld %lld.%09lld %6lldus ",
+                (long long)( s->real_ns / 1000000000LL ), (long long)( s->real_ns % 1000000000LL ),
+                (long long)( s->mono_ns / 1000000000LL ), (long long)( s->mono_ns % 1000000000LL ),
+                (long long)( s->duration_ns / 1000 ) );
     }
-
-    *ma = (float)shunt / 10;
-    return 0;
 }
 
 
 void show_current( void )
 {
+    sample_type s;
     float ma;
 
-    if ( get_current( &ma ) )
+    if ( sample_read( &s ) )
     {
         fprintf( stderr, "Error reading current\n" );
         return;
     }
-    
+    ma = sample_current( &s );
+
+    show_timestamp( &s );
     if ( whole_numbers )
     {
         printf( "%4.0f\n", ma );
@@ -266,27 +348,22 @@ void show_current( void )
 
 void show_voltage( void )
 {
-    float mv;
+    sample_type s;
 
-    if ( get_voltage( &mv ) )
+    if ( sample_read( &s ) )
     {
         fprintf( stderr, "Error reading voltage\n" );
         return;
     }
-    printf( "%4.0f\n", mv );
+
+    show_timestamp( &s );
+    printf( "%4.0f\n", sample_voltage( &s ) );
 }
 
 
-void show_voltage_current( void )
+void print_sample( const sample_type *s, float mv, float ma )
 {
-    float mv, ma;
-
-    if ( get_current( &ma ) || get_voltage( &mv ) )
-    {
-        fprintf( stderr, "Error reading voltage/current\n" );
-        return;
-    }
-
+    show_timestamp( s );
     if ( whole_numbers )
     {
         printf( "%4.0fmV  %4.0fmA\n", mv, ma );
@@ -298,19 +375,126 @@ void show_voltage_current( void )
 }
 
 
+void show_sample( const sample_type *s )
+{
+    print_sample( s, sample_voltage( s ), sample_current( s ) );
+}
+
+
+void show_voltage_current( void )
+{
+    sample_type s;
+
+    if ( sample_read( &s ) )
+    {
+        fprintf( stderr, "Error reading voltage/current\n" );
+        return;
+    }
+
+    show_sample( &s );
+}
+
+
 void monitor( void )
 {
     struct tm *tmptr;
+    sample_type s;
     time_t seconds;
+    float mv, ma;
+    FILE *f = NULL;
+
+    if ( trace_name != NULL )
+    {
+        f = fopen( trace_name, "ab" );
+        if ( f == NULL )
+        {
+            fprintf( stderr, "Error opening %s: %s\n", trace_name, strerror( errno ) );
+            exit( 1 );
+        }
+        trace_writer_init( &trace, f, TRACE_DEFAULT_TICK_NS );
+    }
 
-    while ( 1 )
+    proc_init( &proc, &config );
+    period_init( &period );
+
+    while ( running )
     {
-        seconds = time( NULL );
-        tmptr = localtime( &seconds );
-        printf( "%2d:%02d:%02d ", tmptr->tm_hour, tmptr->tm_min, tmptr->tm_sec );
-        show_voltage_current();
+        if ( sample_read( &s ) )
+        {
+            fprintf( stderr, "Error reading voltage/current\n" );
+        }
+        else
+        {
+            if ( !timestamps )
+            {
+                seconds = s.real_ns / 1000000000LL;
+                tmptr = localtime( &seconds );
+                printf( "%2d:%02d:%02d.%03d ", tmptr->tm_hour, tmptr->tm_min, tmptr->tm_sec,
+                        (int)( ( s.real_ns / 1000000 ) % 1000 ) );
+            }
+            show_sample( &s );
+            mv = sample_voltage( &s );
+            ma = sample_current( &s );
+            proc_print_events( &proc, proc_sample( &proc, &s, mv, ma ) );
+            if ( periodic && period_sample( &period, &s, mv, ma ) )
+            {
+                period_print( &period, s.real_ns );
+            }
+            fflush( stdout );
+
+            if ( ( f != NULL ) && ( trace_writer_append( &trace, &s ) != 0 ) )
+            {
+                fprintf( stderr, "Error writing %s\n", trace_name );
+            }
+        }
         sleep( interval );
     }
+
+    if ( f != NULL )
+    {
+        trace_writer_flush( &trace );
+        fclose( f );
+    }
+}
+
+
+void expand( void )
+{
+    sample_type s[ TRACE_BLOCK_SAMPLES ];
+    short shunt[ TRACE_BLOCK_SAMPLES ], bus[ TRACE_BLOCK_SAMPLES ];
+    float ma[ TRACE_BLOCK_SAMPLES ], mv[ TRACE_BLOCK_SAMPLES ];
+    FILE *f;
+    int i, n;
+
+    f = fopen( trace_name, "rb" );
+    if ( f == NULL )
+    {
+        fprintf( stderr, "Error opening %s: %s\n", trace_name, strerror( errno ) );
+        exit( 1 );
+    }
+
+    timestamps = 1;
+    while ( ( n = trace_read_block( f, s, TRACE_BLOCK_SAMPLES ) ) > 0 )
+    {
+        sample_split( s, shunt, bus, n );
+        sample_convert( shunt, bus, ma, mv, n );
+        for ( i = 0; i < n; i++ )
+        {
+            print_sample( &s[ i ], mv[ i ], ma[ i ] );
+        }
+    }
+
+    if ( n < 0 )
+    {
+        fprintf( stderr, "Corrupt trace block in %s\n", trace_name );
+    }
+    fclose( f );
+}
+
+
+void stop( int sig )
+{
+    running = 0;
 }
 
 
@@ -318,8 +502,18 @@ int main( int argc, char *argv[] )
 {
     char filename[ 20 ];
 
+    proc_config_default( &config );
     parse( argc, argv );
 
+    if ( operation == OP_EXPAND )
+    {
+        expand();
+        return 0;
+    }
+
+    signal( SIGINT, stop );
+    signal( SIGTERM, stop );
+
     snprintf( filename, 19, "/dev/i2c-%d", i2c_bus );
     handle = open( filename, O_RDWR );
     if ( handle < 0 ) 
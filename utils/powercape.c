@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -12,10 +13,7 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <linux/i2c-dev.h>
-#include "../avr/registers.h"
-
-#define AVR_ADDRESS         0x21
-#define INA_ADDRESS         0x40
+#include "powercape.h"
 
 
 typedef enum
@@ -26,12 +24,32 @@ typedef enum
     OP_READ_RTC,
     OP_SET_SYSTIME,
     OP_WRITE_RTC,
-    OP_INFO
+    OP_INFO,
+    OP_DAEMON,
+    OP_CLOCK,
+    OP_TRIM,
+    OP_ALARM,
+    OP_SCHEDULE,
+    OP_APPLY,
+    OP_WATCH,
+    OP_DISCOVER,
+    OP_UPDATE,
+    OP_LATENCY,
+    OP_EVENTS
 } op_type;
 
 op_type operation = OP_NONE;
+char *config_name = NULL;
+int trim_seconds = 0;
+char *alarm_time = NULL;
+char *schedule_name = NULL;
+char *image_name = NULL;
+char *profile_name = NULL;
+int watch_ms = 0;
 
 int i2c_bus = 2;
+int avr_address = AVR_ADDRESS;
+int located = 0;
 int handle;
 
 
@@ -167,6 +185,59 @@ int cape_enter_bootloader( void )
 }
 
 
+int cape_capability( void )
+{
+    unsigned char c;
+
+    if ( register_read( REG_EXTENDED, &c ) != 0 || c != 0x69 )
+    {
+        return -1;
+    }
+    if ( register_read( REG_CAPABILITY, &c ) != 0 )
+    {
+        return -1;
+    }
+
+    return c;
+}
+
+
+// Read the cape RTC along with the system time at the moment it was
+// latched.  Firmware without CAPABILITY_RTC_FRAC reads back whole seconds.
+int cape_read_rtc_frac( struct timespec *cape, struct timespec *sys, int capability )
+{
+    struct timespec t0, t1;
+    unsigned int seconds;
+    unsigned char frac = 0;
+    int64_t mid;
+
+    clock_gettime( CLOCK_REALTIME, &t0 );
+    if ( register32_read( REG_SECONDS_0, &seconds ) != 0 )
+    {
+        return 1;
+    }
+    clock_gettime( CLOCK_REALTIME, &t1 );
+
+    cape->tv_sec = le32toh( seconds );
+    cape->tv_nsec = 0;
+    if ( capability >= CAPABILITY_RTC_FRAC )
+    {
+        if ( register_read( REG_SECONDS_FRAC, &frac ) != 0 )
+        {
+            return 1;
+        }
+        // Middle of the 1/256 s step
+        cape->tv_nsec = ( frac * 1000000000LL + 500000000LL ) / 256;
+    }
+
+    mid = ( ( t0.tv_sec + t1.tv_sec ) * 1000000000LL + t0.tv_nsec + t1.tv_nsec ) / 2;
+    sys->tv_sec = mid / 1000000000LL;
+    sys->tv_nsec = mid % 1000000000LL;
+
+    return 0;
+}
+
+
 int cape_read_rtc( time_t *iptr )
 {
     int rc = 1;
@@ -189,20 +260,149 @@ int cape_read_rtc( time_t *iptr )
 }
 
 
+int cape_set_systime( void )
+{
+    struct timespec cape, sys, now;
+    struct timeval t;
+    int64_t ns;
+
+    if ( cape_read_rtc_frac( &cape, &sys, cape_capability() ) != 0 )
+    {
+        return 1;
+    }
+    printf( ctime( &cape.tv_sec ) );
+
+    // Carry the time spent since the read over to the new system time
+    clock_gettime( CLOCK_REALTIME, &now );
+    ns = cape.tv_sec * 1000000000LL + cape.tv_nsec +
+         ( now.tv_sec - sys.tv_sec ) * 1000000000LL + ( now.tv_nsec - sys.tv_nsec );
+
+    t.tv_sec = ns / 1000000000LL;
+    t.tv_usec = ( ns % 1000000000LL ) / 1000;
+    if ( settimeofday( &t, NULL ) != 0 )
+    {
+        fprintf( stderr, "Error: %s\n", strerror( errno ) );
+        return 1;
+    }
+
+    return 0;
+}
+
+
+// Firmware with CAPABILITY_RTC_FRAC starts the second over when the last
+// byte lands, so the write is timed to finish on the system second.
 int cape_write_rtc( void )
 {
-    int rc = 1;
-    unsigned int seconds = time( NULL );
+    struct timespec t0, t1, ts;
+    unsigned int seconds;
+    int64_t lead, start;
+
+    // A 4-byte read takes about as long on the bus as the write
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+    if ( register32_read( REG_SECONDS_0, &seconds ) != 0 )
+    {
+        return 1;
+    }
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+    lead = ( t1.tv_sec - t0.tv_sec ) * 1000000000LL + ( t1.tv_nsec - t0.tv_nsec );
+    if ( lead > 100000000LL )
+    {
+        lead = 100000000LL;
+    }
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+    seconds = ts.tv_sec + ( ( ts.tv_nsec + lead >= 1000000000LL ) ? 2 : 1 );
+    start = seconds * 1000000000LL - lead;
+    ts.tv_sec = start / 1000000000LL;
+    ts.tv_nsec = start % 1000000000LL;
+    clock_nanosleep( CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL );
+
+    if ( register32_write( REG_SECONDS_0, seconds ) != 0 )
+    {
+        return 1;
+    }
 
     //printf( "System seconds %08X (%d)\n", seconds, seconds );
     printf( ctime( ( time_t* )&seconds ) );
 
-    if ( register32_write( REG_SECONDS_0, seconds ) == 0 )
+    return 0;
+}
+
+
+// <time> is "off", seconds since the epoch, +<seconds> from now, or local
+// "YYYY-MM-DD HH:MM[:SS]".
+int cape_set_alarm( const char *when )
+{
+    struct timespec cape, sys;
+    struct tm tm;
+    time_t t;
+    char *end;
+    int capability;
+
+    capability = cape_capability();
+    if ( capability < CAPABILITY_ALARM )
     {
-        rc = 0;
+        fprintf( stderr, "Cape firmware has no wake-up alarm\n" );
+        return 1;
     }
 
-    return rc;
+    memset( &tm, 0, sizeof( tm ) );
+    if ( strcmp( when, "off" ) == 0 )
+    {
+        t = 0;
+    }
+    else if ( when[ 0 ] == '+' )
+    {
+        t = time( NULL ) + strtol( when + 1, &end, 10 );
+        if ( *end != 0 ) t = -1;
+    }
+    else if ( ( ( end = strptime( when, "%Y-%m-%d %H:%M:%S", &tm ) ) != NULL && *end == 0 ) ||
+              ( ( end = strptime( when, "%Y-%m-%d %H:%M", &tm ) ) != NULL && *end == 0 ) )
+    {
+        tm.tm_isdst = -1;
+        t = mktime( &tm );
+    }
+    else
+    {
+        t = strtol( when, &end, 10 );
+        if ( *end != 0 ) t = -1;
+    }
+
+    if ( t < 0 || t > 0xFFFFFFFFLL )
+    {
+        fprintf( stderr, "Invalid alarm time '%s'\n", when );
+        return 1;
+    }
+
+    if ( t != 0 )
+    {
+        // The alarm compares against the cape clock, not ours
+        if ( cape_read_rtc_frac( &cape, &sys, capability ) == 0 &&
+             llabs( (long long)cape.tv_sec - sys.tv_sec ) > 1 )
+        {
+            fprintf( stderr, "Warning: cape RTC is %+llds from system time, see --write\n",
+                     (long long)cape.tv_sec - sys.tv_sec );
+        }
+        if ( t <= time( NULL ) )
+        {
+            fprintf( stderr, "Warning: alarm time is in the past\n" );
+        }
+    }
+
+    if ( register32_write( REG_ALARM_0, (unsigned int)t ) != 0 )
+    {
+        return 1;
+    }
+
+    if ( t == 0 )
+    {
+        printf( "Alarm off\n" );
+    }
+    else
+    {
+        printf( "Alarm %s", ctime( &t ) );
+    }
+    return 0;
 }
 
 
@@ -227,6 +427,9 @@ int cape_query_reason_power_on( void )
             case 8:
                 printf( "TIMEOUT\n" );
                 break;
+            case 16:
+                printf( "ALARM\n" );
+                break;
             default:
                 printf( "CODE %d\n", reason );
                 break;
@@ -275,7 +478,9 @@ int cape_show_cape_info( void )
 
         if ( c & START_PWRGOOD ) printf( "power good " );
 
-        if ( c & START_TIMEOUT ) printf( "timer" );
+        if ( c & START_TIMEOUT ) printf( "timer " );
+
+        if ( c & START_ALARM ) printf( "alarm" );
 
         printf( "\n" );
     }
@@ -316,6 +521,21 @@ int cape_show_cape_info( void )
         }
     }
 
+    if ( capability >= CAPABILITY_RTC_TRIM )
+    {
+        if ( register_read( REG_RTC_TRIM_0, &c1 ) == 0 && register_read( REG_RTC_TRIM_1, &c2 ) == 0 )
+        {
+            printf( "RTC trim: %+.1f ppm\n", (short)( c1 | ( c2 << 8 ) ) / 10.0 );
+        }
+    }
+
+    if ( capability >= CAPABILITY_EEPROM_QUEUE && register_read( REG_EEPROM_STATUS, &c ) == 0 )
+    {
+        if ( c & EEPROM_STATUS_BUSY ) printf( "EEPROM writes pending\n" );
+
+        if ( c & EEPROM_STATUS_OVERFLOW ) printf( "EEPROM write queue overflowed, settings may not be saved!\n" );
+    }
+
     if ( register_read( REG_START_ENABLE, &c ) == 0 )
     {
         printf( "Allow power on by " );
@@ -326,6 +546,23 @@ int cape_show_cape_info( void )
 
         if ( c & START_PWRGOOD ) printf( "power good signal; " );
 
+        if ( c & START_ALARM && capability >= CAPABILITY_ALARM )
+        {
+            unsigned int alarm;
+
+            if ( register32_read( REG_ALARM_0, &alarm ) == 0 && alarm != 0 )
+            {
+                time_t t = le32toh( alarm );
+
+                printf( "alarm at %.24s; ", ctime( &t ) );
+            }
+        }
+
+        if ( c & START_ALARM && capability >= CAPABILITY_SCHEDULE )
+        {
+            printf( "schedule; " );
+        }
+
         if ( c & START_TIMEOUT )
         {
             unsigned char hours, minutes, seconds;
@@ -353,6 +590,11 @@ int cape_show_cape_info( void )
         printf( "\n" );
     }
 
+    if ( capability >= CAPABILITY_SCHEDULE )
+    {
+        cape_schedule_show();
+    }
+
     if ( register_read( REG_STATUS, &c ) == 0 )
     {
         if ( c & STATUS_BUTTON ) printf( "Button PRESSED\n" );
@@ -385,6 +627,45 @@ int cape_show_cape_info( void )
         }
     }
 
+    if ( capability >= CAPABILITY_SUPPLY )
+    {
+        unsigned char reg = REG_SUPPLY_0, supply[ 4 ];
+
+        // Both bytes of the reading in one burst, with the thresholds
+        if ( i2c_write( &reg, 1 ) == 0 && i2c_read( supply, 4 ) == 0 )
+        {
+            printf( "Supply: %d mV", supply[ 0 ] | ( supply[ 1 ] << 8 ) );
+            if ( supply[ 2 ] != 0 )
+            {
+                printf( ", cutoff %d mV, restart %d mV", supply[ 2 ] * 20,
+                        ( supply[ 3 ] > supply[ 2 ] ? supply[ 3 ] : supply[ 2 ] ) * 20 );
+            }
+            printf( "\n" );
+        }
+        if ( register_read( REG_STATUS, &c ) == 0 && ( c & STATUS_LOW_SUPPLY ) )
+        {
+            printf( "Supply is LOW, wakes are ignored\n" );
+        }
+    }
+
+    if ( capability >= CAPABILITY_SHUTDOWN )
+    {
+        static const char *outcome[] = { "none", "by the host", "clean", "timed out, power cut", "power cut" };
+
+        if ( register_read( REG_SHUTDOWN_TIMEOUT, &c1 ) == 0 && register_read( REG_SHUTDOWN_STATUS, &c2 ) == 0 )
+        {
+            if ( c1 != 0 )
+            {
+                printf( "Shutdown: PWR_BUT then %d seconds to power off", c1 );
+            }
+            else
+            {
+                printf( "Shutdown: power cut at once" );
+            }
+            printf( ", last %s\n", c2 <= SHUTDOWN_FORCED ? outcome[ c2 ] : "unknown" );
+        }
+    }
+
     return 0;
 }
 
@@ -395,13 +676,27 @@ void show_usage( char *progname )
     fprintf( stderr, "   Options:\n" );
     fprintf( stderr, "      -h --help           Show usage.\n" );
     fprintf( stderr, "      -a --address <addr> Use I2C <addr> instead of 0x%02X.\n", AVR_ADDRESS );
+    fprintf( stderr, "      -B --bus <n>        Use /dev/i2c-<n> instead of /dev/i2c-%d.\n", i2c_bus );
+    fprintf( stderr, "                          Without -a or -B the cape is located automatically.\n" );
+    fprintf( stderr, "      -D --discover       Scan all I2C buses for capes.\n" );
+    fprintf( stderr, "      -e --events         Print and clear the cape event log.\n" );
     fprintf( stderr, "      -i --info           Show PowerCape info.\n" );
+    fprintf( stderr, "      -l --latency        Show recent power-up timings.\n" );
+    fprintf( stderr, "      -A --alarm <time>   Wake at <time>: epoch seconds, +<seconds>,\n" );
+    fprintf( stderr, "                          \"YYYY-MM-DD HH:MM[:SS]\" local time, or off.\n" );
     fprintf( stderr, "      -b --boot           Enter bootloader.\n" );
+    fprintf( stderr, "      -c --clock          Slew system time to cape RTC (runs until stopped).\n" );
+    fprintf( stderr, "      -d --daemon <conf>  Arm and feed the cape watchdogs per <conf>.\n" );
+    fprintf( stderr, "      -p --apply <file>   Apply settings profile from <file>.\n" );
     fprintf( stderr, "      -q --query          Query reason for power-on.\n" );
     fprintf( stderr, "                          Output can be TIMEOUT, PGOOD, BUTTON, or OPTO.\n" );
     fprintf( stderr, "      -r --read           Read and display cape RTC value.\n" );
     fprintf( stderr, "      -s --set            Set system time from cape RTC.\n" );
+    fprintf( stderr, "      -S --schedule <file> Upload wake schedule table from <file>.\n" );
+    fprintf( stderr, "      -t --trim <secs>    Measure RTC drift over <secs> and program the trim.\n" );
+    fprintf( stderr, "      -u --update <image> Flash firmware <image> (.hex or .bin) via the bootloader.\n" );
     fprintf( stderr, "      -w --write          Write cape RTC from system time.\n" );
+    fprintf( stderr, "      -W --watch <ms>     Poll registers every <ms> and print changes.\n" );
     exit( 1 );
 }
 
@@ -413,35 +708,121 @@ void parse( int argc, char *argv[] )
         static const struct option lopts[] =
         {
             { "help",       0, 0, 'h' },
+            { "address",    1, 0, 'a' },
+            { "bus",        1, 0, 'B' },
+            { "discover",   0, 0, 'D' },
+            { "events",     0, 0, 'e' },
+            { "alarm",      1, 0, 'A' },
             { "boot",       0, 0, 'b' },
+            { "clock",      0, 0, 'c' },
+            { "daemon",     1, 0, 'd' },
             { "info",       0, 0, 'i' },
+            { "latency",    0, 0, 'l' },
+            { "apply",      1, 0, 'p' },
             { "query",      0, 0, 'q' },
             { "read",       0, 0, 'r' },
             { "set",        0, 0, 's' },
+            { "schedule",   1, 0, 'S' },
+            { "trim",       1, 0, 't' },
+            { "update",     1, 0, 'u' },
             { "write",      0, 0, 'w' },
+            { "watch",      1, 0, 'W' },
             { NULL,         0, 0, 0 },
         };
         int c;
 
-        c = getopt_long( argc, argv, "ihbqrsw", lopts, NULL );
+        c = getopt_long( argc, argv, "iha:A:bB:cd:Delp:qrsS:t:u:wW:", lopts, NULL );
 
         if( c == -1 )
             break;
 
         switch( c )
         {
+            case 'a':
+                {
+                    char *end;
+
+                    avr_address = strtol( optarg, &end, 0 );
+                    if ( *end != 0 || avr_address < 0x08 || avr_address > 0x77 )
+                    {
+                        fprintf( stderr, "Invalid address %s\n", optarg );
+                        exit( 1 );
+                    }
+                    located = 1;
+                    break;
+                }
+
+            case 'B':
+                {
+                    char *end;
+
+                    i2c_bus = strtol( optarg, &end, 0 );
+                    if ( *end != 0 || i2c_bus < 0 )
+                    {
+                        fprintf( stderr, "Invalid bus %s\n", optarg );
+                        exit( 1 );
+                    }
+                    located = 1;
+                    break;
+                }
+
+            case 'D':
+                {
+                    operation = OP_DISCOVER;
+                    break;
+                }
+
+            case 'A':
+                {
+                    operation = OP_ALARM;
+                    alarm_time = optarg;
+                    break;
+                }
+
             case 'b':
                 {
                     operation = OP_BOOT;
                     break;
                 }
 
+            case 'c':
+                {
+                    operation = OP_CLOCK;
+                    break;
+                }
+
+            case 'd':
+                {
+                    operation = OP_DAEMON;
+                    config_name = optarg;
+                    break;
+                }
+
             case 'i':
                 {
                     operation = OP_INFO;
                     break;
                 }
 
+            case 'l':
+                {
+                    operation = OP_LATENCY;
+                    break;
+                }
+
+            case 'e':
+                {
+                    operation = OP_EVENTS;
+                    break;
+                }
+
+            case 'p':
+                {
+                    operation = OP_APPLY;
+                    profile_name = optarg;
+                    break;
+                }
+
             case 'q':
                 {
                     operation = OP_QUERY;
@@ -460,12 +841,50 @@ void parse( int argc, char *argv[] )
                     break;
                 }
 
+            case 'u':
+                {
+                    operation = OP_UPDATE;
+                    image_name = optarg;
+                    break;
+                }
+
+            case 'S':
+                {
+                    operation = OP_SCHEDULE;
+                    schedule_name = optarg;
+                    break;
+                }
+
+            case 't':
+                {
+                    operation = OP_TRIM;
+                    trim_seconds = atoi( optarg );
+                    if ( trim_seconds < 60 )
+                    {
+                        fprintf( stderr, "Measure for at least 60 seconds\n" );
+                        exit( 1 );
+                    }
+                    break;
+                }
+
             case 'w':
                 {
                     operation = OP_WRITE_RTC;
                     break;
                 }
 
+            case 'W':
+                {
+                    operation = OP_WATCH;
+                    watch_ms = atoi( optarg );
+                    if ( watch_ms <= 0 )
+                    {
+                        fprintf( stderr, "Invalid watch interval %s\n", optarg );
+                        exit( 1 );
+                    }
+                    break;
+                }
+
             case 'h':
                 {
                     operation = OP_NONE;
@@ -489,6 +908,16 @@ int main( int argc, char *argv[] )
 
     parse( argc, argv );
 
+    if ( operation == OP_DISCOVER )
+    {
+        return cape_discover_print();
+    }
+
+    if ( !located )
+    {
+        cape_locate();
+    }
+
     snprintf( filename, 19, "/dev/i2c-%d", i2c_bus );
     handle = open( filename, O_RDWR );
 
@@ -498,7 +927,7 @@ int main( int argc, char *argv[] )
         exit( 1 );
     }
 
-    if ( ioctl( handle, I2C_SLAVE, AVR_ADDRESS ) < 0 )
+    if ( ioctl( handle, I2C_SLAVE, avr_address ) < 0 )
     {
         fprintf( stderr, "IOCTL Error: %s\n", strerror( errno ) );
         exit( 1 );
@@ -532,27 +961,73 @@ int main( int argc, char *argv[] )
 
         case OP_SET_SYSTIME:
             {
-                struct timeval t;
+                rc = cape_set_systime();
+                break;
+            }
 
-                rc = cape_read_rtc( &t.tv_sec );
+        case OP_WRITE_RTC:
+            {
+                rc = cape_write_rtc();
+                break;
+            }
 
-                if ( rc == 0 )
-                {
-                    t.tv_usec = 0;
-                    rc = settimeofday( &t, NULL );
+        case OP_CLOCK:
+            {
+                rc = cape_clock_daemon();
+                break;
+            }
 
-                    if ( rc != 0 )
-                    {
-                        fprintf( stderr, "Error: %s\n", strerror( errno ) );
-                    }
-                }
+        case OP_ALARM:
+            {
+                rc = cape_set_alarm( alarm_time );
+                break;
+            }
 
+        case OP_WATCH:
+            {
+                rc = cape_watch( watch_ms );
                 break;
             }
 
-        case OP_WRITE_RTC:
+        case OP_APPLY:
             {
-                rc = cape_write_rtc();
+                rc = cape_profile_apply( profile_name );
+                break;
+            }
+
+        case OP_SCHEDULE:
+            {
+                rc = cape_schedule_upload( schedule_name );
+                break;
+            }
+
+        case OP_UPDATE:
+            {
+                rc = cape_update( image_name );
+                break;
+            }
+
+        case OP_LATENCY:
+            {
+                rc = cape_latency_show();
+                break;
+            }
+
+        case OP_EVENTS:
+            {
+                rc = cape_events_show();
+                break;
+            }
+
+        case OP_TRIM:
+            {
+                rc = cape_clock_calibrate( trim_seconds );
+                break;
+            }
+
+        case OP_DAEMON:
+            {
+                rc = cape_wdt_daemon( config_name );
                 break;
             }
 
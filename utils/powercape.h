@@ -0,0 +1,68 @@
+#ifndef __POWERCAPE_H__
+#define __POWERCAPE_H__
+
+#include <time.h>
+#include "../avr/registers.h"
+
+#define AVR_ADDRESS         0x21
+#define INA_ADDRESS         0x40
+#define BOOTLOADER_ADDRESS  0x20        // twiboot
+
+#define CAPE_MAX_CAPES      8
+
+typedef struct
+{
+    int bus;
+    int address;
+    int capability;
+    int major;
+    int minor;
+} cape_info_type;
+
+extern int i2c_bus;
+extern int avr_address;
+extern int handle;
+
+void msleep( int msecs );
+int i2c_read( void *buf, int len );
+int i2c_write( void *buf, int len );
+int register_read( unsigned char reg, unsigned char *data );
+int register32_read( unsigned char reg, unsigned int *data );
+int register_write( unsigned char reg, unsigned char data );
+int register32_write( unsigned char reg, unsigned int data );
+int cape_capability( void );
+int cape_read_rtc_frac( struct timespec *cape, struct timespec *sys, int capability );
+
+// cape_clock.c
+int cape_clock_daemon( void );
+int cape_clock_calibrate( int duration );
+
+// cape_discover.c
+int cape_discover( cape_info_type *list, int max );
+int cape_discover_print( void );
+int cape_locate( void );
+
+// cape_events.c
+int cape_events_show( void );
+
+// cape_latency.c
+int cape_latency_show( void );
+
+// cape_profile.c
+int cape_profile_apply( const char *name );
+
+// cape_schedule.c
+int cape_schedule_upload( const char *name );
+void cape_schedule_show( void );
+
+// cape_watch.c
+int cape_register_count( int capability );
+int cape_watch( int interval_ms );
+
+// cape_update.c
+int cape_update( const char *name );
+
+// cape_wdt.c
+int cape_wdt_daemon( const char *config );
+
+#endif  // __POWERCAPE_H__
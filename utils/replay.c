@@ -0,0 +1,239 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include "sample.h"
+#include "trace_codec.h"
+#include "trace_proc.h"
+#include "trace_period.h"
+
+// Offline replay of recorded ina219 samples through the same processing
+// the live monitor uses.  Accepts compressed traces (ina219 -o) and text
+// logs produced with ina219 -t.
+
+proc_config config;
+proc_state proc;
+period_state period;
+int periodic = 0;
+long long total = 0;
+
+
+void show_usage( char *progname )
+{
+    fprintf( stderr, "Usage: %s [OPTION] <file> [file...]\n", progname );
+    fprintf( stderr, "   Options:\n" );
+    fprintf( stderr, "      -h --help           Show usage.\n" );
+    fprintf( stderr, "      -p --periodic       Detect periodic loads and their energy.\n" );
+    proc_usage();
+    exit( 1 );
+}
+
+
+void parse( int argc, char *argv[] )
+{
+    while( 1 )
+    {
+        static const struct option lopts[] =
+        {
+            { "help",       0, 0, 'h' },
+            { "periodic",   0, 0, 'p' },
+            PROC_LONG_OPTIONS,
+            { NULL,         0, 0, 0 },
+        };
+        int c;
+
+        c = getopt_long( argc, argv, "hp" PROC_OPTSTRING, lopts, NULL );
+
+        if( c == -1 )
+            break;
+
+        switch ( proc_parse_option( &config, c, optarg ) )
+        {
+            case 1:
+                continue;
+            case -1:
+                exit( 1 );
+        }
+
+        if ( c == 'p' )
+        {
+            periodic = 1;
+            continue;
+        }
+
+        show_usage( argv[ 0 ] );
+    }
+
+    if ( optind >= argc )
+    {
+        show_usage( argv[ 0 ] );
+    }
+}
+
+
+void feed( const sample_type *s, float mv, float ma )
+{
+    int events = proc_sample( &proc, s, mv, ma );
+
+    if ( events )
+    {
+        proc_print_events( &proc, events );
+    }
+    if ( periodic && period_sample( &period, s, mv, ma ) )
+    {
+        period_print( &period, s->real_ns );
+    }
+    total++;
+}
+
+
+// Parse "<real s.ns> <mono s.ns> <dur>us <mV>mV <mA>mA" as written by ina219 -t
+int parse_line( char *line, sample_type *s )
+{
+    char *p = line, *end;
+    long long sec, nsec;
+    double mv, ma;
+
+    sec = strtoll( p, &end, 10 );
+    if ( ( end == p ) || ( *end != '.' ) ) return -1;
+    p = end + 1;
+    nsec = strtoll( p, &end, 10 );
+    if ( end == p ) return -1;
+    s->real_ns = sec * 1000000000LL + nsec;
+
+    p = end;
+    sec = strtoll( p, &end, 10 );
+    if ( ( end == p ) || ( *end != '.' ) ) return -1;
+    p = end + 1;
+    nsec = strtoll( p, &end, 10 );
+    if ( end == p ) return -1;
+    s->mono_ns = sec * 1000000000LL + nsec;
+
+    p = end;
+    s->duration_ns = strtoll( p, &end, 10 ) * 1000;
+    if ( ( end == p ) || strncmp( end, "us", 2 ) ) return -1;
+
+    p = end + 2;
+    mv = strtod( p, &end );
+    if ( ( end == p ) || strncmp( end, "mV", 2 ) ) return -1;
+
+    p = end + 2;
+    ma = strtod( p, &end );
+    if ( ( end == p ) || strncmp( end, "mA", 2 ) ) return -1;
+
+    // Back to raw registers so the conversion path matches the live one
+    s->bus = ( short )( (int)lround( mv ) << 1 );
+    s->shunt = ( short )lround( ma * 10 );
+    return 0;
+}
+
+
+int replay_text( FILE *f, const char *name )
+{
+    char line[ 256 ];
+    sample_type s;
+    long n = 0;
+
+    while ( fgets( line, sizeof( line ), f ) != NULL )
+    {
+        n++;
+        if ( parse_line( line, &s ) != 0 )
+        {
+            fprintf( stderr, "%s:%ld: not a timestamped sample, skipped\n", name, n );
+            continue;
+        }
+        feed( &s, sample_voltage( &s ), sample_current( &s ) );
+    }
+
+    return 0;
+}
+
+
+int replay_trace( FILE *f, const char *name )
+{
+    sample_type s[ TRACE_BLOCK_SAMPLES ];
+    short shunt[ TRACE_BLOCK_SAMPLES ], bus[ TRACE_BLOCK_SAMPLES ];
+    float ma[ TRACE_BLOCK_SAMPLES ], mv[ TRACE_BLOCK_SAMPLES ];
+    int i, n;
+
+    while ( ( n = trace_read_block( f, s, TRACE_BLOCK_SAMPLES ) ) > 0 )
+    {
+        sample_split( s, shunt, bus, n );
+        sample_convert( shunt, bus, ma, mv, n );
+        for ( i = 0; i < n; i++ )
+        {
+            feed( &s[ i ], mv[ i ], ma[ i ] );
+        }
+    }
+
+    if ( n < 0 )
+    {
+        fprintf( stderr, "%s: corrupt trace block\n", name );
+        return -1;
+    }
+    return 0;
+}
+
+
+int replay( const char *name )
+{
+    unsigned char magic[ 2 ];
+    FILE *f;
+    int rc;
+
+    f = fopen( name, "rb" );
+    if ( f == NULL )
+    {
+        fprintf( stderr, "Error opening %s: %s\n", name, strerror( errno ) );
+        return -1;
+    }
+
+    if ( ( fread( magic, 1, 2, f ) == 2 ) && ( ( magic[ 0 ] | ( magic[ 1 ] << 8 ) ) == TRACE_MAGIC ) )
+    {
+        rewind( f );
+        rc = replay_trace( f, name );
+    }
+    else
+    {
+        rewind( f );
+        rc = replay_text( f, name );
+    }
+
+    fclose( f );
+    return rc;
+}
+
+
+int main( int argc, char *argv[] )
+{
+    struct timespec t0, t1;
+    double elapsed;
+    int rc = 0;
+
+    proc_config_default( &config );
+    parse( argc, argv );
+    proc_init( &proc, &config );
+    period_init( &period );
+
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+    for ( ; optind < argc; optind++ )
+    {
+        if ( replay( argv[ optind ] ) != 0 )
+        {
+            rc = 1;
+        }
+    }
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+
+    proc_print_summary( &proc );
+
+    elapsed = ( t1.tv_sec - t0.tv_sec ) + ( t1.tv_nsec - t0.tv_nsec ) / 1e9;
+    fprintf( stderr, "Replayed %lld samples in %.3fs (%.0f samples/s)\n",
+             total, elapsed, elapsed > 0 ? total / elapsed : 0.0 );
+
+    return rc;
+}
@@ -0,0 +1,211 @@
+#include <stddef.h>
+#include "sample.h"
+
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+#include <arm_neon.h>
+#define SAMPLE_NEON
+#elif defined( __SSE2__ )
+#include <immintrin.h>
+#define SAMPLE_SSE2
+#if defined( __GNUC__ ) && !defined( __AVX2__ )
+#define SAMPLE_AVX2_DISPATCH
+#endif
+#endif
+
+
+float sample_voltage( const sample_type *s )
+{
+    return ( float )( ( s->bus & 0xFFF8 ) >> 1 );
+}
+
+
+float sample_current( const sample_type *s )
+{
+    return (float)s->shunt / 10;
+}
+
+
+// Batch conversion
+//
+// Every kernel must return bit-identical results to sample_voltage() and
+// sample_current().  Bus voltage is an integer, so that is trivial.  The
+// current is a correctly rounded float division by 10, which SSE/AVX and
+// AArch64 do natively.  ARMv7 NEON has no divide, so the shunt value is
+// split as |x| = 10q + r and the result built as q + RN(r/10), which is
+// exact over the whole 16-bit range (checked by trace_bench).
+
+void sample_convert_scalar( const short *shunt, const short *bus, float *ma, float *mv, size_t count )
+{
+    size_t i;
+
+    for ( i = 0; i < count; i++ )
+    {
+        mv[ i ] = ( float )( ( bus[ i ] & 0xFFF8 ) >> 1 );
+        ma[ i ] = (float)shunt[ i ] / 10;
+    }
+}
+
+
+#if defined( SAMPLE_NEON )
+
+static void convert_neon( const short *shunt, const short *bus, float *ma, float *mv, size_t count )
+{
+    const uint16x8_t mask = vdupq_n_u16( 0xFFF8 );
+    size_t i;
+
+#if defined( __aarch64__ )
+    const float32x4_t ten = vdupq_n_f32( 10.0f );
+#else
+    const uint32x4_t magic = vdupq_n_u32( 52429 );
+    const uint32x4_t ten = vdupq_n_u32( 10 );
+    const uint32x4_t nine = vdupq_n_u32( 9 );
+    const float32x4_t tenth = vdupq_n_f32( 0.1f );
+    const float32x4_t nine_tenths = vdupq_n_f32( 0.9f );
+#endif
+
+    for ( i = 0; i + 8 <= count; i += 8 )
+    {
+        uint16x8_t b = vshrq_n_u16( vandq_u16( vld1q_u16( (const uint16_t*)&bus[ i ] ), mask ), 1 );
+        int16x8_t s = vld1q_s16( &shunt[ i ] );
+        int32x4_t lo = vmovl_s16( vget_low_s16( s ) );
+        int32x4_t hi = vmovl_s16( vget_high_s16( s ) );
+        int k;
+
+        vst1q_f32( &mv[ i ], vcvtq_f32_u32( vmovl_u16( vget_low_u16( b ) ) ) );
+        vst1q_f32( &mv[ i + 4 ], vcvtq_f32_u32( vmovl_u16( vget_high_u16( b ) ) ) );
+
+        for ( k = 0; k < 2; k++ )
+        {
+            int32x4_t x = k ? hi : lo;
+            float32x4_t f;
+#if defined( __aarch64__ )
+            f = vdivq_f32( vcvtq_f32_s32( x ), ten );
+#else
+            uint32x4_t m = vreinterpretq_u32_s32( vabsq_s32( x ) );
+            uint32x4_t q = vshrq_n_u32( vmulq_u32( m, magic ), 19 );
+            uint32x4_t r = vmlsq_u32( m, q, ten );
+            float32x4_t fr = vmulq_f32( vcvtq_f32_u32( r ), tenth );
+            uint32x4_t neg = vcltq_s32( x, vdupq_n_s32( 0 ) );
+
+            fr = vbslq_f32( vceqq_u32( r, nine ), nine_tenths, fr );
+            f = vaddq_f32( vcvtq_f32_u32( q ), fr );
+            f = vreinterpretq_f32_u32( veorq_u32( vreinterpretq_u32_f32( f ),
+                                                  vandq_u32( neg, vdupq_n_u32( 0x80000000 ) ) ) );
+#endif
+            vst1q_f32( &ma[ i + k * 4 ], f );
+        }
+    }
+
+    sample_convert_scalar( &shunt[ i ], &bus[ i ], &ma[ i ], &mv[ i ], count - i );
+}
+
+#endif
+
+
+#if defined( SAMPLE_SSE2 ) && !defined( __AVX2__ )
+
+static void convert_sse2( const short *shunt, const short *bus, float *ma, float *mv, size_t count )
+{
+    const __m128i mask = _mm_set1_epi16( (short)0xFFF8 );
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 ten = _mm_set1_ps( 10.0f );
+    size_t i;
+
+    for ( i = 0; i + 8 <= count; i += 8 )
+    {
+        __m128i b = _mm_srli_epi16( _mm_and_si128( _mm_loadu_si128( (const __m128i*)&bus[ i ] ), mask ), 1 );
+        __m128i s = _mm_loadu_si128( (const __m128i*)&shunt[ i ] );
+        __m128i sign = _mm_srai_epi16( s, 15 );
+
+        _mm_storeu_ps( &mv[ i ], _mm_cvtepi32_ps( _mm_unpacklo_epi16( b, zero ) ) );
+        _mm_storeu_ps( &mv[ i + 4 ], _mm_cvtepi32_ps( _mm_unpackhi_epi16( b, zero ) ) );
+        _mm_storeu_ps( &ma[ i ], _mm_div_ps( _mm_cvtepi32_ps( _mm_unpacklo_epi16( s, sign ) ), ten ) );
+        _mm_storeu_ps( &ma[ i + 4 ], _mm_div_ps( _mm_cvtepi32_ps( _mm_unpackhi_epi16( s, sign ) ), ten ) );
+    }
+
+    sample_convert_scalar( &shunt[ i ], &bus[ i ], &ma[ i ], &mv[ i ], count - i );
+}
+
+#endif
+
+
+#if defined( __AVX2__ ) || defined( SAMPLE_AVX2_DISPATCH )
+
+__attribute__(( target( "avx2" ) ))
+static void convert_avx2( const short *shunt, const short *bus, float *ma, float *mv, size_t count )
+{
+    const __m256i mask = _mm256_set1_epi32( 0xFFF8 );
+    const __m256 ten = _mm256_set1_ps( 10.0f );
+    size_t i;
+
+    for ( i = 0; i + 8 <= count; i += 8 )
+    {
+        __m256i b = _mm256_cvtepu16_epi32( _mm_loadu_si128( (const __m128i*)&bus[ i ] ) );
+        __m256i s = _mm256_cvtepi16_epi32( _mm_loadu_si128( (const __m128i*)&shunt[ i ] ) );
+
+        _mm256_storeu_ps( &mv[ i ], _mm256_cvtepi32_ps( _mm256_srli_epi32( _mm256_and_si256( b, mask ), 1 ) ) );
+        _mm256_storeu_ps( &ma[ i ], _mm256_div_ps( _mm256_cvtepi32_ps( s ), ten ) );
+    }
+
+    sample_convert_scalar( &shunt[ i ], &bus[ i ], &ma[ i ], &mv[ i ], count - i );
+}
+
+#endif
+
+
+const char *sample_convert_isa( void )
+{
+#if defined( SAMPLE_NEON )
+    return "neon";
+#elif defined( __AVX2__ )
+    return "avx2";
+#elif defined( SAMPLE_AVX2_DISPATCH )
+    return __builtin_cpu_supports( "avx2" ) ? "avx2" : "sse2";
+#elif defined( SAMPLE_SSE2 )
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+
+void sample_convert( const short *shunt, const short *bus, float *ma, float *mv, size_t count )
+{
+#if defined( SAMPLE_NEON )
+    convert_neon( shunt, bus, ma, mv, count );
+#elif defined( __AVX2__ )
+    convert_avx2( shunt, bus, ma, mv, count );
+#elif defined( SAMPLE_AVX2_DISPATCH )
+    static int avx2 = -1;
+
+    if ( avx2 < 0 )
+    {
+        avx2 = __builtin_cpu_supports( "avx2" ) ? 1 : 0;
+    }
+
+    if ( avx2 )
+    {
+        convert_avx2( shunt, bus, ma, mv, count );
+    }
+    else
+    {
+        convert_sse2( shunt, bus, ma, mv, count );
+    }
+#elif defined( SAMPLE_SSE2 )
+    convert_sse2( shunt, bus, ma, mv, count );
+#else
+    sample_convert_scalar( shunt, bus, ma, mv, count );
+#endif
+}
+
+
+void sample_split( const sample_type *s, short *shunt, short *bus, size_t count )
+{
+    size_t i;
+
+    for ( i = 0; i < count; i++ )
+    {
+        shunt[ i ] = s[ i ].shunt;
+        bus[ i ] = s[ i ].bus;
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef __SAMPLE_H__
+#define __SAMPLE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One INA219 reading: raw shunt/bus registers plus the time they were taken.
+typedef struct {
+    int64_t mono_ns;            // CLOCK_MONOTONIC_RAW at transaction midpoint
+    int64_t real_ns;            // CLOCK_REALTIME at transaction midpoint
+    int64_t duration_ns;        // Time spent on the bus for this sample
+    short shunt;                // Raw shunt voltage register
+    short bus;                  // Raw bus voltage register
+} sample_type;
+
+float sample_voltage( const sample_type *s );
+float sample_current( const sample_type *s );
+
+// Batch conversion of raw registers to mA/mV using the best SIMD kernel
+// available; results are identical to the single-sample functions.
+void sample_convert( const short *shunt, const short *bus, float *ma, float *mv, size_t count );
+void sample_convert_scalar( const short *shunt, const short *bus, float *ma, float *mv, size_t count );
+void sample_split( const sample_type *s, short *shunt, short *bus, size_t count );
+const char *sample_convert_isa( void );
+
+#endif  // __SAMPLE_H__
@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "trace_codec.h"
+#include "trace_period.h"
+
+// Throughput and ratio benchmark for the trace codec using a synthetic
+// battery trace: 1 Hz sampling with scheduling jitter, a realtime clock
+// slewed by NTP and stepped once, a slowly sagging bus voltage and a noisy
+// current with periodic load spikes.  Also checks the
+// batch conversion kernel against the scalar conversion for every possible
+// register value and compares their speed, and checks that the period
+// detector finds pulse trains across its range.
+
+#define BENCH_SAMPLES       ( 1 << 20 )
+
+
+static double now( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void generate( sample_type *s, int count )
+{
+    int64_t mono = 1000000000LL, real_offset = 1600000000000000000LL;
+    int i;
+
+    srand( 1 );
+    for ( i = 0; i < count; i++ )
+    {
+        double mv = 4100.0 - 600.0 * i / count;
+        double ma = 250.0 + ( rand() % 40 ) - 20 + ( ( i % 300 ) < 5 ? 400.0 : 0.0 );
+
+        mono += 1000000000LL + ( rand() % 200000 ) - 100000;
+        real_offset += 50000 + ( i == count / 2 ? 1234567890LL : 0 );
+        s[ i ].mono_ns = mono;
+        s[ i ].real_ns = mono + real_offset;
+        s[ i ].duration_ns = 400000 + ( rand() % 20000 );
+        s[ i ].bus = ( short )( ( (int)lround( mv ) << 1 ) & 0xFFF8 ) | 0x0002;
+        s[ i ].shunt = ( short )lround( ma * 10 );
+    }
+}
+
+
+// Every 16-bit input must convert bit-identically to sample_voltage() and
+// sample_current().
+static int verify_convert( void )
+{
+    static short shunt[ 65536 ], bus[ 65536 ];
+    static float ma[ 65536 ], mv[ 65536 ];
+    sample_type s;
+    int i;
+
+    for ( i = 0; i < 65536; i++ )
+    {
+        shunt[ i ] = bus[ i ] = ( short )i;
+    }
+    // Odd offset exercises the unaligned head and scalar tail
+    sample_convert( shunt + 1, bus + 1, ma + 1, mv + 1, 65535 );
+    sample_convert( shunt, bus, ma, mv, 1 );
+
+    for ( i = 0; i < 65536; i++ )
+    {
+        s.shunt = s.bus = ( short )i;
+        if ( memcmp( &ma[ i ], &( float ){ sample_current( &s ) }, sizeof( float ) ) ||
+             memcmp( &mv[ i ], &( float ){ sample_voltage( &s ) }, sizeof( float ) ) )
+        {
+            fprintf( stderr, "Conversion mismatch for %04X: %f/%f\n", i & 0xFFFF, ma[ i ], mv[ i ] );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Narrow pulses on a noisy baseline, 1 Hz sampling.  Such a train has
+// stronger harmonics than fundamental, so the detector must still report
+// the full period first.
+static int verify_period( void )
+{
+    static const double cases[][ 2 ] = { { 300, 5 }, { 250, 3 }, { 100, 5 }, { 60, 5 }, { 10, 1 } };
+    static period_state ps;
+    sample_type s;
+    double ma;
+    int c, i, ok;
+
+    memset( &s, 0, sizeof( s ) );
+    for ( c = 0; c < (int)( sizeof( cases ) / sizeof( cases[ 0 ] ) ); c++ )
+    {
+        period_init( &ps );
+        srand( 1 );
+        ok = 0;
+        for ( i = 0; i < 4 * PERIOD_WINDOW; i++ )
+        {
+            s.mono_ns = i * 1000000000LL;
+            ma = 100 + ( rand() % 40 ) - 20 + ( fmod( i, cases[ c ][ 0 ] ) < cases[ c ][ 1 ] ? 400 : 0 );
+            if ( period_sample( &ps, &s, 4000, ma ) )
+            {
+                ok = ( ps.found > 0 ) && ( fabs( ps.result[ 0 ].period_s / cases[ c ][ 0 ] - 1 ) < 0.03 );
+            }
+        }
+        if ( !ok )
+        {
+            fprintf( stderr, "Period %.0fs with %.0fs pulses reported as %.1fs\n", cases[ c ][ 0 ], cases[ c ][ 1 ],
+                     ps.found > 0 ? ps.result[ 0 ].period_s : 0.0 );
+            return -1;
+        }
+    }
+    printf( "Period detector: %d pulse trains found\n", c );
+    return 0;
+}
+
+
+static void bench_convert( const sample_type *s, int count )
+{
+    short *shunt = malloc( sizeof( short ) * count );
+    short *bus = malloc( sizeof( short ) * count );
+    float *ma = malloc( sizeof( float ) * count );
+    float *mv = malloc( sizeof( float ) * count );
+    double t0, t1, t2;
+
+    if ( !shunt || !bus || !ma || !mv )
+    {
+        return;
+    }
+
+    sample_split( s, shunt, bus, count );
+    t0 = now();
+    sample_convert_scalar( shunt, bus, ma, mv, count );
+    t1 = now();
+    sample_convert( shunt, bus, ma, mv, count );
+    t2 = now();
+
+    printf( "Convert scalar: %.1f Msamples/s\n", count / ( t1 - t0 ) / 1e6 );
+    printf( "Convert %s: %.1f Msamples/s\n", sample_convert_isa(), count / ( t2 - t1 ) / 1e6 );
+
+    free( mv );
+    free( ma );
+    free( bus );
+    free( shunt );
+}
+
+
+int main( int argc, char *argv[] )
+{
+    sample_type *in, *out;
+    uint8_t *buf;
+    size_t used = 0, len;
+    double t0, t1, t2;
+    int i, n, decoded = 0, blocks = 0;
+
+    in = malloc( sizeof( sample_type ) * BENCH_SAMPLES );
+    out = malloc( sizeof( sample_type ) * BENCH_SAMPLES );
+    buf = malloc( ( BENCH_SAMPLES / TRACE_BLOCK_SAMPLES ) * TRACE_BLOCK_MAX );
+    if ( !in || !out || !buf )
+    {
+        fprintf( stderr, "Out of memory\n" );
+        return 1;
+    }
+
+    generate( in, BENCH_SAMPLES );
+
+    t0 = now();
+    for ( i = 0; i < BENCH_SAMPLES; i += TRACE_BLOCK_SAMPLES )
+    {
+        len = trace_block_encode( &in[ i ], TRACE_BLOCK_SAMPLES, TRACE_DEFAULT_TICK_NS,
+                                  buf + used, TRACE_BLOCK_MAX );
+        if ( len == 0 )
+        {
+            fprintf( stderr, "Encode failed at sample %d\n", i );
+            return 1;
+        }
+        used += len;
+        blocks++;
+    }
+
+    t1 = now();
+    for ( len = 0; len < used; )
+    {
+        trace_block_info info;
+
+        trace_block_header( buf + len, used - len, &info );
+        n = trace_block_decode( buf + len, used - len, &out[ decoded ], BENCH_SAMPLES - decoded );
+        if ( n < 0 )
+        {
+            fprintf( stderr, "Decode failed at byte %zu\n", len );
+            return 1;
+        }
+        decoded += n;
+        len += TRACE_HEADER_SIZE + info.payload;
+    }
+    t2 = now();
+
+    // Timestamps are quantized to the tick, the real time through both the
+    // monotonic time and its offset
+    for ( i = 0; i < BENCH_SAMPLES; i++ )
+    {
+        if ( ( out[ i ].shunt != in[ i ].shunt ) || ( out[ i ].bus != in[ i ].bus ) ||
+             ( llabs( out[ i ].mono_ns - in[ i ].mono_ns ) > TRACE_DEFAULT_TICK_NS ) ||
+             ( llabs( out[ i ].real_ns - in[ i ].real_ns ) > TRACE_DEFAULT_TICK_NS ) ||
+             ( llabs( out[ i ].duration_ns - in[ i ].duration_ns ) > TRACE_DEFAULT_TICK_NS ) )
+        {
+            fprintf( stderr, "Mismatch at sample %d\n", i );
+            return 1;
+        }
+    }
+
+    printf( "%d samples in %d blocks, %zu bytes (%.2f bits/sample, raw %zu bits)\n",
+            BENCH_SAMPLES, blocks, used, used * 8.0 / BENCH_SAMPLES, sizeof( sample_type ) * 8 );
+    printf( "Encode: %.1f Msamples/s\n", BENCH_SAMPLES / ( t1 - t0 ) / 1e6 );
+    printf( "Decode: %.1f Msamples/s\n", BENCH_SAMPLES / ( t2 - t1 ) / 1e6 );
+
+    if ( verify_convert() != 0 || verify_period() != 0 )
+    {
+        return 1;
+    }
+    bench_convert( in, BENCH_SAMPLES );
+
+    free( buf );
+    free( out );
+    free( in );
+    return 0;
+}
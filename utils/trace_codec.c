@@ -0,0 +1,480 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "trace_codec.h"
+
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t pos;
+    uint64_t acc;
+    int bits;
+    int overflow;
+} bit_writer;
+
+typedef struct {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+    uint64_t acc;
+    int bits;
+    int overflow;
+} bit_reader;
+
+
+static void bw_put( bit_writer *w, uint32_t value, int n )
+{
+    if ( n < 32 )
+    {
+        value &= ( 1UL << n ) - 1;
+    }
+    w->acc = ( w->acc << n ) | value;
+    w->bits += n;
+
+    while ( w->bits >= 8 )
+    {
+        w->bits -= 8;
+        if ( w->pos < w->len )
+        {
+            w->buf[ w->pos++ ] = ( uint8_t )( w->acc >> w->bits );
+        }
+        else
+        {
+            w->overflow = 1;
+        }
+    }
+}
+
+
+static void bw_finish( bit_writer *w )
+{
+    if ( w->bits > 0 )
+    {
+        bw_put( w, 0, 8 - w->bits );
+    }
+}
+
+
+static uint32_t br_get( bit_reader *r, int n )
+{
+    while ( r->bits < n )
+    {
+        r->acc <<= 8;
+        if ( r->pos < r->len )
+        {
+            r->acc |= r->buf[ r->pos++ ];
+        }
+        else
+        {
+            r->overflow = 1;
+        }
+        r->bits += 8;
+    }
+
+    r->bits -= n;
+    if ( n < 32 )
+    {
+        return ( uint32_t )( r->acc >> r->bits ) & ( ( 1UL << n ) - 1 );
+    }
+    return ( uint32_t )( r->acc >> r->bits );
+}
+
+
+static uint64_t zigzag( int64_t v )
+{
+    return ( (uint64_t)v << 1 ) ^ (uint64_t)( v >> 63 );
+}
+
+
+static int64_t unzigzag( uint64_t z )
+{
+    return (int64_t)( z >> 1 ) ^ -(int64_t)( z & 1 );
+}
+
+
+// Time deltas: '0' | '10'+7 | '110'+12 | '1110'+20 | '1111'+64
+static void put_time( bit_writer *w, int64_t v )
+{
+    uint64_t z = zigzag( v );
+
+    if ( z == 0 )
+    {
+        bw_put( w, 0x0, 1 );
+    }
+    else if ( z < ( 1 << 7 ) )
+    {
+        bw_put( w, 0x2, 2 );
+        bw_put( w, z, 7 );
+    }
+    else if ( z < ( 1 << 12 ) )
+    {
+        bw_put( w, 0x6, 3 );
+        bw_put( w, z, 12 );
+    }
+    else if ( z < ( 1 << 20 ) )
+    {
+        bw_put( w, 0xE, 4 );
+        bw_put( w, z, 20 );
+    }
+    else
+    {
+        bw_put( w, 0xF, 4 );
+        bw_put( w, ( uint32_t )( z >> 32 ), 32 );
+        bw_put( w, ( uint32_t )z, 32 );
+    }
+}
+
+
+static int64_t get_time( bit_reader *r )
+{
+    uint64_t z;
+
+    if ( br_get( r, 1 ) == 0 )
+    {
+        return 0;
+    }
+    if ( br_get( r, 1 ) == 0 )
+    {
+        return unzigzag( br_get( r, 7 ) );
+    }
+    if ( br_get( r, 1 ) == 0 )
+    {
+        return unzigzag( br_get( r, 12 ) );
+    }
+    if ( br_get( r, 1 ) == 0 )
+    {
+        return unzigzag( br_get( r, 20 ) );
+    }
+    z = (uint64_t)br_get( r, 32 ) << 32;
+    z |= br_get( r, 32 );
+    return unzigzag( z );
+}
+
+
+// Register deltas: '0' | '10'+4 | '110'+8 | '111'+16
+static void put_value( bit_writer *w, short prev, short cur )
+{
+    uint16_t z = ( uint16_t )zigzag( ( int16_t )( cur - prev ) );
+
+    if ( z == 0 )
+    {
+        bw_put( w, 0x0, 1 );
+    }
+    else if ( z < ( 1 << 4 ) )
+    {
+        bw_put( w, 0x2, 2 );
+        bw_put( w, z, 4 );
+    }
+    else if ( z < ( 1 << 8 ) )
+    {
+        bw_put( w, 0x6, 3 );
+        bw_put( w, z, 8 );
+    }
+    else
+    {
+        bw_put( w, 0x7, 3 );
+        bw_put( w, z, 16 );
+    }
+}
+
+
+static short get_value( bit_reader *r, short prev )
+{
+    uint16_t z;
+
+    if ( br_get( r, 1 ) == 0 )
+    {
+        return prev;
+    }
+    if ( br_get( r, 1 ) == 0 )
+    {
+        z = br_get( r, 4 );
+    }
+    else if ( br_get( r, 1 ) == 0 )
+    {
+        z = br_get( r, 8 );
+    }
+    else
+    {
+        z = br_get( r, 16 );
+    }
+    return ( short )( uint16_t )( prev + ( int16_t )unzigzag( z ) );
+}
+
+
+static void put_le( uint8_t *p, uint64_t v, int bytes )
+{
+    int i;
+
+    for ( i = 0; i < bytes; i++ )
+    {
+        p[ i ] = ( uint8_t )( v >> ( i * 8 ) );
+    }
+}
+
+
+static uint64_t get_le( const uint8_t *p, int bytes )
+{
+    uint64_t v = 0;
+    int i;
+
+    for ( i = bytes - 1; i >= 0; i-- )
+    {
+        v = ( v << 8 ) | p[ i ];
+    }
+    return v;
+}
+
+
+static int64_t quantize( int64_t ns, uint32_t tick_ns )
+{
+    if ( ns >= 0 )
+    {
+        return ( ns + tick_ns / 2 ) / tick_ns;
+    }
+    return -( ( -ns + tick_ns / 2 ) / tick_ns );
+}
+
+
+size_t trace_block_encode( const sample_type *samples, int count, uint32_t tick_ns,
+                           uint8_t *out, size_t outlen )
+{
+    bit_writer w;
+    int64_t t, last_t = 0, last_delta = 0;
+    int64_t off, last_off = 0;
+    int64_t dur, last_dur = 0;
+    int64_t real_offset;
+    int i;
+
+    if ( ( count <= 0 ) || ( count > 0xFFFF ) || ( tick_ns == 0 ) || ( outlen < TRACE_HEADER_SIZE ) )
+    {
+        return 0;
+    }
+
+    memset( &w, 0, sizeof( w ) );
+    w.buf = out + TRACE_HEADER_SIZE;
+    w.len = outlen - TRACE_HEADER_SIZE;
+
+    real_offset = samples[ 0 ].real_ns - samples[ 0 ].mono_ns;
+
+    for ( i = 0; i < count; i++ )
+    {
+        const sample_type *s = &samples[ i ];
+
+        t = quantize( s->mono_ns - samples[ 0 ].mono_ns, tick_ns );
+        off = quantize( s->real_ns - s->mono_ns - real_offset, tick_ns );
+        dur = quantize( s->duration_ns, tick_ns );
+
+        if ( i == 0 )
+        {
+            bw_put( &w, ( uint16_t )s->shunt, 16 );
+            bw_put( &w, ( uint16_t )s->bus, 16 );
+            put_time( &w, dur );
+        }
+        else
+        {
+            put_time( &w, ( t - last_t ) - last_delta );
+            put_time( &w, off - last_off );
+            put_time( &w, dur - last_dur );
+            put_value( &w, samples[ i - 1 ].shunt, s->shunt );
+            put_value( &w, samples[ i - 1 ].bus, s->bus );
+            last_delta = t - last_t;
+        }
+
+        last_t = t;
+        last_off = off;
+        last_dur = dur;
+    }
+    bw_finish( &w );
+
+    if ( w.overflow || ( w.pos > 0xFFFF ) )
+    {
+        return 0;
+    }
+
+    put_le( out + 0, TRACE_MAGIC, 2 );
+    out[ 2 ] = TRACE_VERSION;
+    out[ 3 ] = 0;
+    put_le( out + 4, count, 2 );
+    put_le( out + 6, w.pos, 2 );
+    put_le( out + 8, samples[ 0 ].mono_ns, 8 );
+    put_le( out + 16, samples[ count - 1 ].mono_ns, 8 );
+    put_le( out + 24, real_offset, 8 );
+    put_le( out + 32, tick_ns, 4 );
+
+    return TRACE_HEADER_SIZE + w.pos;
+}
+
+
+int trace_block_header( const uint8_t *in, size_t len, trace_block_info *info )
+{
+    if ( ( len < TRACE_HEADER_SIZE ) ||
+         ( get_le( in, 2 ) != TRACE_MAGIC ) ||
+         ( in[ 2 ] != TRACE_VERSION ) )
+    {
+        return -1;
+    }
+
+    info->count          = get_le( in + 4, 2 );
+    info->payload        = get_le( in + 6, 2 );
+    info->first_mono_ns  = (int64_t)get_le( in + 8, 8 );
+    info->last_mono_ns   = (int64_t)get_le( in + 16, 8 );
+    info->real_offset_ns = (int64_t)get_le( in + 24, 8 );
+    info->tick_ns        = get_le( in + 32, 4 );
+
+    if ( info->tick_ns == 0 )
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+int trace_block_decode( const uint8_t *in, size_t len, sample_type *samples, int max )
+{
+    trace_block_info info;
+    bit_reader r;
+    int64_t t = 0, delta = 0, off = 0, dur = 0;
+    int i;
+
+    if ( trace_block_header( in, len, &info ) != 0 )
+    {
+        return -1;
+    }
+    if ( ( info.count > max ) || ( TRACE_HEADER_SIZE + info.payload > len ) )
+    {
+        return -1;
+    }
+
+    memset( &r, 0, sizeof( r ) );
+    r.buf = in + TRACE_HEADER_SIZE;
+    r.len = info.payload;
+
+    for ( i = 0; i < info.count; i++ )
+    {
+        sample_type *s = &samples[ i ];
+
+        if ( i == 0 )
+        {
+            s->shunt = ( short )br_get( &r, 16 );
+            s->bus = ( short )br_get( &r, 16 );
+            dur = get_time( &r );
+        }
+        else
+        {
+            delta += get_time( &r );
+            t += delta;
+            off += get_time( &r );
+            dur += get_time( &r );
+            s->shunt = get_value( &r, samples[ i - 1 ].shunt );
+            s->bus = get_value( &r, samples[ i - 1 ].bus );
+        }
+
+        s->mono_ns = info.first_mono_ns + t * info.tick_ns;
+        s->real_ns = s->mono_ns + info.real_offset_ns + off * info.tick_ns;
+        s->duration_ns = dur * info.tick_ns;
+    }
+
+    if ( r.overflow )
+    {
+        return -1;
+    }
+    return info.count;
+}
+
+
+void trace_writer_init( trace_writer *w, FILE *file, uint32_t tick_ns )
+{
+    w->file = file;
+    w->tick_ns = tick_ns ? tick_ns : TRACE_DEFAULT_TICK_NS;
+    w->count = 0;
+}
+
+
+int trace_writer_flush( trace_writer *w )
+{
+    uint8_t block[ TRACE_BLOCK_MAX ];
+    size_t len;
+
+    if ( w->count == 0 )
+    {
+        return 0;
+    }
+
+    len = trace_block_encode( w->samples, w->count, w->tick_ns, block, sizeof( block ) );
+    w->count = 0;
+    if ( ( len == 0 ) || ( fwrite( block, 1, len, w->file ) != len ) )
+    {
+        return -1;
+    }
+    return fflush( w->file ) == 0 ? 0 : -1;
+}
+
+
+int trace_writer_append( trace_writer *w, const sample_type *s )
+{
+    w->samples[ w->count++ ] = *s;
+    if ( w->count == TRACE_BLOCK_SAMPLES )
+    {
+        return trace_writer_flush( w );
+    }
+    return 0;
+}
+
+
+// Returns number of samples read, 0 at end of file, -1 on a corrupt block.
+int trace_read_block( FILE *file, sample_type *samples, int max )
+{
+    uint8_t block[ TRACE_HEADER_SIZE + 0xFFFF ];
+    trace_block_info info;
+    size_t n;
+
+    n = fread( block, 1, TRACE_HEADER_SIZE, file );
+    if ( n == 0 )
+    {
+        return 0;
+    }
+    if ( ( n != TRACE_HEADER_SIZE ) || ( trace_block_header( block, n, &info ) != 0 ) )
+    {
+        return -1;
+    }
+    if ( fread( block + TRACE_HEADER_SIZE, 1, info.payload, file ) != info.payload )
+    {
+        return -1;
+    }
+
+    return trace_block_decode( block, TRACE_HEADER_SIZE + info.payload, samples, max );
+}
+
+
+// Position the file at the block containing mono_ns (or the first block
+// after it) by walking the block headers only.
+int trace_seek( FILE *file, int64_t mono_ns )
+{
+    uint8_t header[ TRACE_HEADER_SIZE ];
+    trace_block_info info;
+    long pos;
+
+    rewind( file );
+
+    while ( 1 )
+    {
+        pos = ftell( file );
+        if ( ( fread( header, 1, sizeof( header ), file ) != sizeof( header ) ) ||
+             ( trace_block_header( header, sizeof( header ), &info ) != 0 ) )
+        {
+            return -1;
+        }
+
+        if ( info.last_mono_ns >= mono_ns )
+        {
+            return fseek( file, pos, SEEK_SET );
+        }
+
+        if ( fseek( file, info.payload, SEEK_CUR ) != 0 )
+        {
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef __TRACE_CODEC_H__
+#define __TRACE_CODEC_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sample.h"
+
+// Compressed sample trace format
+//
+// A trace is a sequence of self-contained blocks.  Each block starts with a
+// fixed header holding the sample count, payload size and the first/last
+// monotonic timestamps so a reader can skip to any point in time without
+// decoding.  Inside the payload, timestamps are delta-of-delta encoded and
+// the raw registers are zigzag delta encoded into variable-length bit
+// buckets, so a steady sample rate and a slowly moving battery voltage cost
+// a few bits per sample.
+//
+// Timestamps are quantized to tick_ns (default 1us) relative to the first
+// sample of the block, which is stored exactly.
+
+#define TRACE_MAGIC             0x5449      // "IT"
+#define TRACE_VERSION           1
+#define TRACE_HEADER_SIZE       36
+#define TRACE_BLOCK_SAMPLES     256
+#define TRACE_SAMPLE_MAX_BYTES  32
+#define TRACE_BLOCK_MAX         ( TRACE_HEADER_SIZE + TRACE_BLOCK_SAMPLES * TRACE_SAMPLE_MAX_BYTES )
+#define TRACE_DEFAULT_TICK_NS   1000
+
+typedef struct {
+    int count;                  // Samples in block
+    size_t payload;             // Payload bytes following the header
+    int64_t first_mono_ns;
+    int64_t last_mono_ns;
+    int64_t real_offset_ns;     // real_ns - mono_ns of the first sample
+    uint32_t tick_ns;
+} trace_block_info;
+
+typedef struct {
+    FILE *file;
+    uint32_t tick_ns;
+    int count;
+    sample_type samples[ TRACE_BLOCK_SAMPLES ];
+} trace_writer;
+
+// Block level interface
+size_t trace_block_encode( const sample_type *samples, int count, uint32_t tick_ns,
+                           uint8_t *out, size_t outlen );
+int trace_block_header( const uint8_t *in, size_t len, trace_block_info *info );
+int trace_block_decode( const uint8_t *in, size_t len, sample_type *samples, int max );
+
+// Stream interface
+void trace_writer_init( trace_writer *w, FILE *file, uint32_t tick_ns );
+int trace_writer_append( trace_writer *w, const sample_type *s );
+int trace_writer_flush( trace_writer *w );
+int trace_read_block( FILE *file, sample_type *samples, int max );
+int trace_seek( FILE *file, int64_t mono_ns );
+
+#endif  // __TRACE_CODEC_H__
@@ -0,0 +1,354 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "trace_period.h"
+#include "trace_proc.h"
+
+#define REFINE_STEPS        16
+
+
+void period_init( period_state *ps )
+{
+    int k;
+
+    memset( ps, 0, sizeof( *ps ) );
+
+    // Longest period first
+    for ( k = 0; k < PERIOD_BINS; k++ )
+    {
+        double w;
+
+        ps->period[ k ] = (double)PERIOD_WINDOW / ( PERIOD_K_MIN + k );
+        w = 2 * M_PI / ps->period[ k ];
+
+        ps->rot_re[ k ] = cos( w );
+        ps->rot_im[ k ] = sin( w );
+    }
+}
+
+
+// Window sample i, 0 = newest
+static float window_ma( period_state *ps, int i )
+{
+    return ps->ma[ ( ps->head + PERIOD_WINDOW - 1 - i ) % PERIOD_WINDOW ];
+}
+
+
+// Exact bin value over the window with the mean removed
+static double evaluate( period_state *ps, double period, double *re_out, double *im_out )
+{
+    double w = 2 * M_PI / period;
+    double mean = ps->sum_ma / PERIOD_WINDOW;
+    double c = cos( w ), s = sin( w );
+    double pr = 1, pi = 0, t;
+    double re = 0, im = 0;
+    int i;
+
+    for ( i = 0; i < PERIOD_WINDOW; i++ )
+    {
+        double x = window_ma( ps, i ) - mean;
+
+        re += x * pr;
+        im += x * pi;
+        t = pr * c - pi * s;
+        pi = pr * s + pi * c;
+        pr = t;
+    }
+
+    if ( re_out ) *re_out = re;
+    if ( im_out ) *im_out = im;
+    return re * re + im * im;
+}
+
+
+// Rebuild the sliding bins from the window to drop accumulated rounding.
+static void resync( period_state *ps )
+{
+    double re, im;
+    int k;
+
+    // The sliding bins carry one extra rotation (newest sample at e^{jw})
+    for ( k = 0; k < PERIOD_BINS; k++ )
+    {
+        evaluate( ps, ps->period[ k ], &re, &im );
+        ps->x_re[ k ] = re * ps->rot_re[ k ] - im * ps->rot_im[ k ];
+        ps->x_im[ k ] = re * ps->rot_im[ k ] + im * ps->rot_re[ k ];
+    }
+}
+
+
+static int compare_double( const void *a, const void *b )
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return ( x > y ) - ( x < y );
+}
+
+
+// Power of the bins either side of a period
+static double bin_power( period_state *ps, double period )
+{
+    int k = ( int )( PERIOD_WINDOW / period ) - PERIOD_K_MIN;
+    double pw = 0;
+
+    if ( ( k >= 0 ) && ( k < PERIOD_BINS ) ) pw = ps->power[ k ];
+    if ( ( k + 1 >= 0 ) && ( k + 1 < PERIOD_BINS ) && ( ps->power[ k + 1 ] > pw ) ) pw = ps->power[ k + 1 ];
+    return pw;
+}
+
+
+// Strongest period between lo and hi
+static double refine( period_state *ps, double lo, double hi, double *power )
+{
+    double p, pw, best_p = ( lo + hi ) / 2;
+
+    *power = 0;
+    for ( p = lo; p <= hi; p += ( hi - lo ) / REFINE_STEPS )
+    {
+        pw = evaluate( ps, p, NULL, NULL );
+        if ( pw > *power )
+        {
+            *power = pw;
+            best_p = p;
+        }
+        if ( hi == lo ) break;
+    }
+    return best_p;
+}
+
+
+// A narrow pulse train puts less power in its fundamental than in its
+// harmonics, so the strongest peak can be a harmonic whose fundamental is
+// not a candidate at all.  The longest period m times as long whose other
+// harmonics, m/h for h < m, all stand out is taken as the fundamental.
+// For a load that really repeats at the peak those fall on noise.
+static double subharmonic( period_state *ps, double period, double power, double median, double *out_power )
+{
+    double f, lo, hi, pw;
+    int m, h;
+
+    for ( m = ( int )( PERIOD_WINDOW / PERIOD_K_MIN / period ); m > 1; m-- )
+    {
+        f = period * m;
+        for ( h = 1; h < m; h++ )
+        {
+            pw = bin_power( ps, f / h );
+            if ( ( pw <= PERIOD_THRESHOLD * median ) || ( pw < power / 8 ) ) break;
+        }
+        if ( h == m )
+        {
+            lo = (double)PERIOD_WINDOW / ( PERIOD_WINDOW / f + 0.5 );
+            hi = (double)PERIOD_WINDOW / ( PERIOD_WINDOW / f - 0.5 );
+            return refine( ps, lo, hi, out_power );
+        }
+    }
+
+    *out_power = power;
+    return period;
+}
+
+
+static int is_multiple( double longer, double shorter )
+{
+    double n = longer / shorter;
+
+    return ( n > 1.5 ) && ( fabs( n - floor( n + 0.5 ) ) < 0.06 * n );
+}
+
+
+// Energy drawn above the baseline per occurrence, from the window folded at
+// the given period.
+static double fold_energy( period_state *ps, double period, double dt )
+{
+    double mean_mv = ps->sum_mv / PERIOD_WINDOW;
+    double baseline, charge = 0;
+    int i, b, used = 0;
+
+    memset( ps->fold, 0, sizeof( ps->fold ) );
+    memset( ps->fold_n, 0, sizeof( ps->fold_n ) );
+
+    for ( i = 0; i < PERIOD_WINDOW; i++ )
+    {
+        b = ( int )( fmod( i, period ) / period * PERIOD_PHASES );
+        ps->fold[ b ] += window_ma( ps, i );
+        ps->fold_n[ b ]++;
+    }
+
+    for ( b = 0; b < PERIOD_PHASES; b++ )
+    {
+        if ( ps->fold_n[ b ] )
+        {
+            ps->fold[ used ] = ps->fold[ b ] / ps->fold_n[ b ];
+            ps->fold_sorted[ used ] = ps->fold[ used ];
+            used++;
+        }
+    }
+    if ( used == 0 )
+    {
+        return 0;
+    }
+
+    qsort( ps->fold_sorted, used, sizeof( double ), compare_double );
+    baseline = ps->fold_sorted[ used / 2 ];
+
+    for ( b = 0; b < used; b++ )
+    {
+        charge += fabs( ps->fold[ b ] - baseline );
+    }
+
+    // mA * s * mV = uJ
+    return charge * ( period * dt / used ) * mean_mv / 1000;
+}
+
+
+static void analyse( period_state *ps )
+{
+    int64_t span = ps->mono_ns[ ( ps->head + PERIOD_WINDOW - 1 ) % PERIOD_WINDOW ] -
+                   ps->mono_ns[ ps->head ];
+    double dt = span / 1e9 / ( PERIOD_WINDOW - 1 );
+    double median, lo, hi, re, im;
+    double chosen[ PERIOD_REPORT ];
+    int order[ PERIOD_BINS ];
+    int k, j, n, found = 0;
+
+    for ( k = 0; k < PERIOD_BINS; k++ )
+    {
+        re = ps->x_re[ k ];
+        im = ps->x_im[ k ];
+        ps->power[ k ] = re * re + im * im;
+        ps->sorted[ k ] = ps->power[ k ];
+    }
+    qsort( ps->sorted, PERIOD_BINS, sizeof( double ), compare_double );
+    median = ps->sorted[ PERIOD_BINS / 2 ];
+
+    // Peaks in descending power
+    for ( k = 0, n = 0; k < PERIOD_BINS; k++ )
+    {
+        if ( ( ps->power[ k ] > PERIOD_THRESHOLD * median ) &&
+             ( ( k == 0 ) || ( ps->power[ k ] > ps->power[ k - 1 ] ) ) &&
+             ( ( k == PERIOD_BINS - 1 ) || ( ps->power[ k ] >= ps->power[ k + 1 ] ) ) )
+        {
+            for ( j = n++; ( j > 0 ) && ( ps->power[ order[ j - 1 ] ] < ps->power[ k ] ); j-- )
+            {
+                order[ j ] = order[ j - 1 ];
+            }
+            order[ j ] = k;
+        }
+    }
+
+    // Refine the strongest peaks between their neighbouring bins
+    if ( n > PERIOD_CANDIDATES )
+    {
+        n = PERIOD_CANDIDATES;
+    }
+    for ( j = 0; j < n; j++ )
+    {
+        k = order[ j ];
+        lo = ps->period[ k < PERIOD_BINS - 1 ? k + 1 : k ];
+        hi = ps->period[ k > 0 ? k - 1 : k ];
+        ps->cand_period[ j ] = refine( ps, lo, hi, &ps->cand_power[ j ] );
+        ps->cand_period[ j ] = subharmonic( ps, ps->cand_period[ j ], ps->cand_power[ j ], median,
+                                            &ps->cand_power[ j ] );
+    }
+
+    // Keep fundamentals only: drop repeats, harmonics of another peak and
+    // sidelobes of a much stronger nearby one.
+    for ( j = 0; ( j < n ) && ( found < PERIOD_REPORT ); j++ )
+    {
+        for ( k = 0; k < found; k++ )
+        {
+            if ( fabs( chosen[ k ] / ps->cand_period[ j ] - 1 ) < 0.03 ) break;
+        }
+        if ( k < found )
+        {
+            continue;
+        }
+        for ( k = 0; k < n; k++ )
+        {
+            if ( k == j ) continue;
+            if ( is_multiple( ps->cand_period[ k ], ps->cand_period[ j ] ) ) break;
+            if ( ( ps->cand_power[ k ] > 8 * ps->cand_power[ j ] ) &&
+                 ( fabs( 1 / ps->cand_period[ k ] - 1 / ps->cand_period[ j ] ) < 3.0 / PERIOD_WINDOW ) ) break;
+        }
+        if ( k < n )
+        {
+            continue;
+        }
+
+        chosen[ found ] = ps->cand_period[ j ];
+        ps->result[ found ].amplitude_ma = 2 * sqrt( ps->cand_power[ j ] ) / PERIOD_WINDOW;
+        found++;
+    }
+
+    for ( k = 0; k < found; k++ )
+    {
+        ps->result[ k ].period_s = chosen[ k ] * dt;
+        ps->result[ k ].energy_mj = fold_energy( ps, chosen[ k ], dt );
+    }
+    ps->found = found;
+}
+
+
+// Returns 1 when a new analysis is ready for period_print().
+int period_sample( period_state *ps, const sample_type *s, float mv, float ma )
+{
+    double old = ps->ma[ ps->head ];
+    int k;
+
+    if ( ps->count < PERIOD_WINDOW )
+    {
+        old = 0;
+    }
+    else
+    {
+        ps->sum_ma -= old;
+        ps->sum_mv -= ps->mv[ ps->head ];
+    }
+
+    // Whole cycles per window, so e^{jwN} = 1 and the oldest sample drops
+    // out before the rotation.
+    for ( k = 0; k < PERIOD_BINS; k++ )
+    {
+        double re = ps->x_re[ k ] + ma - old, im = ps->x_im[ k ];
+
+        ps->x_re[ k ] = re * ps->rot_re[ k ] - im * ps->rot_im[ k ];
+        ps->x_im[ k ] = re * ps->rot_im[ k ] + im * ps->rot_re[ k ];
+    }
+
+    ps->ma[ ps->head ] = ma;
+    ps->mv[ ps->head ] = mv;
+    ps->mono_ns[ ps->head ] = s->mono_ns;
+    ps->sum_ma += ma;
+    ps->sum_mv += mv;
+    ps->head = ( ps->head + 1 ) % PERIOD_WINDOW;
+    ps->count++;
+
+    if ( ps->count < PERIOD_WINDOW )
+    {
+        return 0;
+    }
+    if ( ps->count % PERIOD_WINDOW == 0 )
+    {
+        resync( ps );
+    }
+    if ( ps->count % PERIOD_HOP == 0 )
+    {
+        analyse( ps );
+        return 1;
+    }
+    return 0;
+}
+
+
+void period_print( period_state *ps, int64_t real_ns )
+{
+    int k;
+
+    for ( k = 0; k < ps->found; k++ )
+    {
+        proc_print_time( real_ns );
+        printf( "PERIOD %.1fs amplitude %.1fmA %.3fmJ/occurrence\n",
+                ps->result[ k ].period_s, ps->result[ k ].amplitude_ma, ps->result[ k ].energy_mj );
+    }
+}
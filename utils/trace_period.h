@@ -0,0 +1,70 @@
+#ifndef __TRACE_PERIOD_H__
+#define __TRACE_PERIOD_H__
+
+#include <stdint.h>
+#include "sample.h"
+
+// Periodic load detector
+//
+// A bank of sliding DFT bins (one recursive Goertzel resonator per bin)
+// runs over the last PERIOD_WINDOW current samples, so each new sample costs
+// PERIOD_BINS complex updates.  Bins sit on the DFT grid of the window, k
+// cycles per window, which matches the resolution the window can give and
+// keeps the mean out of every bin.  Every PERIOD_HOP samples the strongest
+// periods are refined, reported, and the energy drawn per occurrence is
+// found by folding the window at that period.  A peak whose subharmonics
+// all stand out too is taken for a harmonic of a narrow pulse train and
+// reported at the train's period.  All storage lives in
+// period_state; nothing is allocated after period_init().
+
+#define PERIOD_WINDOW       1024        // Samples analysed
+#define PERIOD_HOP          256         // Samples between reports
+#define PERIOD_K_MIN        3           // Longest period: window / 3
+#define PERIOD_K_MAX        ( PERIOD_WINDOW * 2 / 5 )   // Shortest: 2.5 samples
+#define PERIOD_BINS         ( PERIOD_K_MAX - PERIOD_K_MIN + 1 )
+#define PERIOD_PHASES       64          // Fold resolution for energy
+#define PERIOD_REPORT       3           // Periods reported per hop
+#define PERIOD_CANDIDATES   12          // Peaks refined per hop
+#define PERIOD_THRESHOLD    8.0         // Peak power over median bin power
+
+typedef struct {
+    double period_s;            // Period of the load
+    double amplitude_ma;        // Fundamental amplitude
+    double energy_mj;           // Energy above baseline per occurrence
+} period_result;
+
+typedef struct {
+    // Constant per bin
+    double period[ PERIOD_BINS ];       // In samples
+    double rot_re[ PERIOD_BINS ];       // e^{jw}
+    double rot_im[ PERIOD_BINS ];
+
+    // Sliding state
+    double x_re[ PERIOD_BINS ];
+    double x_im[ PERIOD_BINS ];
+    float ma[ PERIOD_WINDOW ];
+    int64_t mono_ns[ PERIOD_WINDOW ];
+    double sum_ma;
+    double sum_mv;
+    float mv[ PERIOD_WINDOW ];
+    int head;
+    long count;
+
+    // Scratch for reporting
+    double power[ PERIOD_BINS ];
+    double sorted[ PERIOD_BINS ];
+    double cand_period[ PERIOD_CANDIDATES ];
+    double cand_power[ PERIOD_CANDIDATES ];
+    double fold[ PERIOD_PHASES ];
+    double fold_sorted[ PERIOD_PHASES ];
+    int fold_n[ PERIOD_PHASES ];
+
+    int found;
+    period_result result[ PERIOD_REPORT ];
+} period_state;
+
+void period_init( period_state *ps );
+int period_sample( period_state *ps, const sample_type *s, float mv, float ma );
+void period_print( period_state *ps, int64_t real_ns );
+
+#endif  // __TRACE_PERIOD_H__
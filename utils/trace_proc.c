@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "trace_proc.h"
+
+
+void proc_config_default( proc_config *cfg )
+{
+    memset( cfg, 0, sizeof( *cfg ) );
+    cfg->capacity_mah = 2000;
+    cfg->full_mv = 4150;
+    cfg->empty_mv = 3300;
+}
+
+
+// Returns 1 if the option was consumed, 0 if it is not a processing option
+// and -1 if its argument is invalid.
+int proc_parse_option( proc_config *cfg, int c, const char *arg )
+{
+    char *end;
+    double v;
+
+    if ( ( c == 0 ) || ( strchr( PROC_OPTSTRING, c ) == NULL ) || ( c == ':' ) )
+    {
+        return 0;
+    }
+
+    v = strtod( arg, &end );
+    if ( ( end == arg ) || ( *end != 0 ) || ( v < 0 ) )
+    {
+        fprintf( stderr, "Invalid value %s for -%c.\n", arg, c );
+        return -1;
+    }
+
+    switch ( c )
+    {
+        case 'C': cfg->capacity_mah = v; break;
+        case 'E': cfg->empty_mv = v; break;
+        case 'F': cfg->full_mv = v; break;
+        case 'L': cfg->low_mv = v; break;
+        case 'M': cfg->max_ma = v; break;
+        case 'R': cfg->report_ns = ( int64_t )( v * 1e9 ); break;
+        case 'S': cfg->low_soc = v; break;
+    }
+
+    return 1;
+}
+
+
+void proc_usage( void )
+{
+    fprintf( stderr, "   Processing:\n" );
+    fprintf( stderr, "      -C --capacity <mAh> Battery capacity for state of charge.\n" );
+    fprintf( stderr, "      -E --empty <mV>     Battery voltage at 0%% charge.\n" );
+    fprintf( stderr, "      -F --full <mV>      Battery voltage at 100%% charge.\n" );
+    fprintf( stderr, "      -L --low <mV>       Alarm below battery voltage.\n" );
+    fprintf( stderr, "      -M --max <mA>       Alarm above absolute current.\n" );
+    fprintf( stderr, "      -S --soc-alarm <%%>  Alarm below state of charge.\n" );
+    fprintf( stderr, "      -R --report <s>     Print statistics every <s> seconds of sample time.\n" );
+}
+
+
+static void stats_reset( proc_stats *st )
+{
+    memset( st, 0, sizeof( *st ) );
+}
+
+
+static void stats_add( proc_stats *st, const sample_type *s, float mv, float ma )
+{
+    if ( st->count == 0 )
+    {
+        st->start_real_ns = s->real_ns;
+        st->min_mv = st->max_mv = mv;
+        st->min_ma = st->max_ma = ma;
+    }
+    if ( mv < st->min_mv ) st->min_mv = mv;
+    if ( mv > st->max_mv ) st->max_mv = mv;
+    if ( ma < st->min_ma ) st->min_ma = ma;
+    if ( ma > st->max_ma ) st->max_ma = ma;
+    if ( s->duration_ns > st->max_duration_ns ) st->max_duration_ns = s->duration_ns;
+
+    st->sum_mv += mv;
+    st->sum_ma += ma;
+    st->count++;
+}
+
+
+void proc_init( proc_state *p, const proc_config *cfg )
+{
+    memset( p, 0, sizeof( *p ) );
+    p->cfg = *cfg;
+    p->soc = -1;
+    stats_reset( &p->stats );
+    stats_reset( &p->report );
+}
+
+
+static uint8_t check_alarms( proc_state *p, float mv, float ma )
+{
+    uint8_t a = 0;
+
+    if ( ( p->cfg.low_mv > 0 ) && ( mv < p->cfg.low_mv ) )
+    {
+        a |= PROC_ALARM_LOW_VOLTAGE;
+    }
+    if ( ( p->cfg.max_ma > 0 ) && ( ( ma > p->cfg.max_ma ) || ( ma < -p->cfg.max_ma ) ) )
+    {
+        a |= PROC_ALARM_OVERCURRENT;
+    }
+    if ( ( p->cfg.low_soc > 0 ) && ( p->soc >= 0 ) && ( p->soc < p->cfg.low_soc ) )
+    {
+        a |= PROC_ALARM_LOW_SOC;
+    }
+
+    return a;
+}
+
+
+// Feed one sample through statistics, coulomb counting, state of charge and
+// alarms.  mv/ma are the converted registers of s (see sample_convert()).
+// Returns a mask of PROC_EVENT_* for the caller to act on.
+int proc_sample( proc_state *p, const sample_type *s, float mv, float ma )
+{
+    int events = 0;
+    uint8_t a;
+
+    if ( p->soc < 0 )
+    {
+        // Seed from voltage on the first sample
+        float span = p->cfg.full_mv - p->cfg.empty_mv;
+
+        p->soc = ( span > 0 ) ? ( mv - p->cfg.empty_mv ) * 100 / span : 0;
+        if ( p->soc < 0 ) p->soc = 0;
+        if ( p->soc > 100 ) p->soc = 100;
+
+        p->now_ns = p->report_start_ns = s->mono_ns;
+        p->last_ma = ma;
+    }
+    else
+    {
+        int64_t dt = s->mono_ns - p->now_ns;
+
+        if ( ( dt <= 0 ) || ( dt > PROC_MAX_GAP_NS ) )
+        {
+            // Clock went backwards or trace has a hole: don't integrate
+            events |= PROC_EVENT_GAP;
+            p->report_start_ns = s->mono_ns;
+        }
+        else
+        {
+            double mah = ( p->last_ma + ma ) / 2 * ( dt / 3600e9 );
+
+            p->charge_mah += mah;
+            p->stats.mah += mah;
+            if ( p->cfg.capacity_mah > 0 )
+            {
+                p->soc += mah * 100 / p->cfg.capacity_mah;
+                if ( p->soc < 0 ) p->soc = 0;
+                if ( p->soc > 100 ) p->soc = 100;
+            }
+        }
+
+        p->now_ns = s->mono_ns;
+        p->last_ma = ma;
+    }
+    p->real_ns = s->real_ns;
+
+    if ( ( p->cfg.report_ns > 0 ) && ( p->now_ns - p->report_start_ns >= p->cfg.report_ns ) )
+    {
+        p->report = p->stats;
+        stats_reset( &p->stats );
+        p->report_start_ns += ( ( p->now_ns - p->report_start_ns ) / p->cfg.report_ns ) * p->cfg.report_ns;
+        events |= PROC_EVENT_REPORT;
+    }
+    stats_add( &p->stats, s, mv, ma );
+
+    a = check_alarms( p, mv, ma );
+    p->changed = a ^ p->alarms;
+    if ( p->changed & a )
+    {
+        events |= PROC_EVENT_ALARM;
+    }
+    if ( p->changed & ~a )
+    {
+        events |= PROC_EVENT_CLEAR;
+    }
+    p->alarms = a;
+
+    return events;
+}
+
+
+void proc_print_time( int64_t real_ns )
+{
+    time_t t = real_ns / 1000000000LL;
+    struct tm *tmptr = localtime( &t );
+
+    printf( "%04d-%02d-%02d %2d:%02d:%02d.%03d ",
+            tmptr->tm_year + 1900, tmptr->tm_mon + 1, tmptr->tm_mday,
+            tmptr->tm_hour, tmptr->tm_min, tmptr->tm_sec,
+            (int)( ( real_ns / 1000000 ) % 1000 ) );
+}
+
+
+static void print_alarms( uint8_t mask )
+{
+    if ( mask & PROC_ALARM_LOW_VOLTAGE ) printf( " LOW_VOLTAGE" );
+    if ( mask & PROC_ALARM_OVERCURRENT ) printf( " OVERCURRENT" );
+    if ( mask & PROC_ALARM_LOW_SOC ) printf( " LOW_SOC" );
+}
+
+
+void proc_print_events( proc_state *p, int events )
+{
+    if ( events & PROC_EVENT_REPORT )
+    {
+        proc_stats *r = &p->report;
+
+        if ( r->count > 0 )
+        {
+            proc_print_time( r->start_real_ns );
+            printf( "STATS n=%ld V %4.0f/%4.0f/%4.0fmV I %.1f/%.1f/%.1fmA %+.3fmAh SoC %.1f%% bus %lldus\n",
+                    r->count,
+                    r->min_mv, r->sum_mv / r->count, r->max_mv,
+                    r->min_ma, r->sum_ma / r->count, r->max_ma,
+                    r->mah, p->soc, (long long)( r->max_duration_ns / 1000 ) );
+        }
+    }
+
+    if ( events & PROC_EVENT_GAP )
+    {
+        proc_print_time( p->real_ns );
+        printf( "GAP\n" );
+    }
+
+    if ( events & PROC_EVENT_ALARM )
+    {
+        proc_print_time( p->real_ns );
+        printf( "ALARM" );
+        print_alarms( p->changed & p->alarms );
+        printf( "\n" );
+    }
+
+    if ( events & PROC_EVENT_CLEAR )
+    {
+        proc_print_time( p->real_ns );
+        printf( "CLEAR" );
+        print_alarms( p->changed & ~p->alarms );
+        printf( "\n" );
+    }
+}
+
+
+void proc_print_summary( proc_state *p )
+{
+    printf( "Net charge %+.3fmAh, state of charge %.1f%%\n", p->charge_mah, p->soc < 0 ? 0 : p->soc );
+}
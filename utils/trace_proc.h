@@ -0,0 +1,88 @@
+#ifndef __TRACE_PROC_H__
+#define __TRACE_PROC_H__
+
+#include <stdint.h>
+#include "sample.h"
+
+// Sample processing shared by the live monitor and offline replay
+//
+// All timing is taken from the sample timestamps (a virtual clock), never
+// from the host clock, so a replayed trace produces exactly the output the
+// live monitor would have produced, just as fast as it can be read.
+//
+// Current is positive when flowing into the battery.
+
+// Events returned by proc_sample()
+#define PROC_EVENT_REPORT       0x01    // Report interval elapsed
+#define PROC_EVENT_ALARM        0x02    // One or more alarms raised
+#define PROC_EVENT_CLEAR        0x04    // One or more alarms cleared
+#define PROC_EVENT_GAP          0x08    // Sample gap larger than PROC_MAX_GAP_NS
+
+// Alarm bits
+#define PROC_ALARM_LOW_VOLTAGE  0x01
+#define PROC_ALARM_OVERCURRENT  0x02
+#define PROC_ALARM_LOW_SOC      0x04
+
+#define PROC_MAX_GAP_NS         ( 3600LL * 1000000000LL )
+
+// getopt fragments for the processing options
+#define PROC_OPTSTRING          "C:E:F:L:M:R:S:"
+#define PROC_LONG_OPTIONS   \
+    { "capacity",   1, 0, 'C' },    \
+    { "empty",      1, 0, 'E' },    \
+    { "full",       1, 0, 'F' },    \
+    { "low",        1, 0, 'L' },    \
+    { "max",        1, 0, 'M' },    \
+    { "report",     1, 0, 'R' },    \
+    { "soc-alarm",  1, 0, 'S' }
+
+typedef struct {
+    float capacity_mah;         // Battery capacity for state of charge
+    float full_mv;              // Open-circuit voltage at 100%
+    float empty_mv;             // Open-circuit voltage at 0%
+    float low_mv;               // Low voltage alarm threshold (0 disables)
+    float max_ma;               // Over-current alarm threshold (0 disables)
+    float low_soc;              // Low state of charge alarm (0 disables)
+    int64_t report_ns;          // Statistics report interval (0 disables)
+} proc_config;
+
+typedef struct {
+    int64_t start_real_ns;      // Wall time of first sample in interval
+    long count;
+    float min_mv, max_mv;
+    float min_ma, max_ma;
+    double sum_mv, sum_ma;
+    double mah;                 // Net charge over the interval
+    int64_t max_duration_ns;    // Slowest bus transaction
+} proc_stats;
+
+typedef struct {
+    proc_config cfg;
+
+    int64_t now_ns;             // Virtual clock (monotonic ns of last sample)
+    int64_t real_ns;            // Wall time of last sample
+    int64_t report_start_ns;
+    float last_ma;
+
+    proc_stats stats;           // Current report interval
+    proc_stats report;          // Last completed interval
+
+    // Coulomb counter and state of charge
+    double charge_mah;          // Net charge since start
+    float soc;                  // Percent, < 0 until seeded
+
+    uint8_t alarms;             // Active alarms
+    uint8_t changed;            // Alarms that changed on the last sample
+} proc_state;
+
+void proc_config_default( proc_config *cfg );
+int proc_parse_option( proc_config *cfg, int c, const char *arg );
+void proc_usage( void );
+
+void proc_init( proc_state *p, const proc_config *cfg );
+int proc_sample( proc_state *p, const sample_type *s, float mv, float ma );
+void proc_print_events( proc_state *p, int events );
+void proc_print_summary( proc_state *p );
+void proc_print_time( int64_t real_ns );
+
+#endif  // __TRACE_PROC_H__